@@ -0,0 +1,147 @@
+"""Extract the (node kind, parent kind) training pairs of ast2vec in a
+stream.
+
+Unlike fast_pickle_file_to_nodes.py, no sample dict is made per node and
+nothing is held for the whole corpus: the trees are walked one at a time
+and their pairs are written as int32 (node, parent) rows, chunk_size rows
+at a time, to the end of an append-only binary file, so that memory stays
+flat however large the corpus. The input is either a pickle of
+fast_merge_pickles_to_pickle.py, which is loaded whole, or better, the ast
+directory it merges (ast/LABEL/LANG/*.pkl), whose files are read one by one.
+
+The kind vocabulary (maps.LANG.pa, see map3.py) is updated in memory with
+every kind seen and written once at the end. train.py trains on the pairs
+file directly, see sampling.load_pairs."""
+
+import os
+import pickle
+import argparse
+from collections import deque
+import numpy as np
+import pyarrow
+
+CHUNK_SIZE = 1 << 16
+
+
+class PairWriter(object):
+    """Buffers pairs in a fixed int32 array and appends it to path when
+    full."""
+
+    def __init__(self, path, chunk_size=CHUNK_SIZE):
+        self.file = open(path, 'ab')
+        self.chunk = np.zeros((chunk_size, 2), dtype=np.int32)
+        self.size = 0
+        self.count = 0
+
+    def add(self, node, parent):
+        self.chunk[self.size] = (node, parent)
+        self.size += 1
+        if self.size == len(self.chunk):
+            self.flush()
+
+    def flush(self):
+        self.file.write(self.chunk[:self.size].tobytes())
+        self.count += self.size
+        self.size = 0
+
+    def close(self):
+        self.flush()
+        self.file.close()
+
+
+def iter_trees(infile, lang=None):
+    """The protobuf trees of a merged pickle, or of the LANG files of an ast
+    directory, one at a time."""
+    if not os.path.isdir(infile):
+        with open(infile, 'rb') as file_handler:
+            for item in pickle.load(file_handler):
+                yield item['tree']
+        return
+    for root, directories, files in os.walk(infile):
+        directories.sort()
+        if os.path.basename(root) != lang:
+            continue
+        for name in sorted(files):
+            try:
+                with open(os.path.join(root, name), 'rb') as file_handler:
+                    tree = pickle.load(file_handler)
+            except Exception as err:
+                print(err)
+                continue
+            yield tree
+
+
+def extract_pairs(tree, writer, maps, node_counts):
+    """Write the (kind, parent kind) of every node of tree below its root,
+    in breadth first order."""
+    if not tree.HasField("element"):
+        return
+    queue = deque([tree.element])
+    while queue:
+        node = queue.popleft()
+        for child in node.child:
+            if str(child.kind) not in maps:
+                maps[str(child.kind)] = str(len(maps) + 1)
+            writer.add(child.kind, node.kind)
+            node_counts[child.kind] = node_counts.get(child.kind, 0) + 1
+            queue.append(child)
+
+
+def load_maps(map_filename):
+    if not os.path.exists(map_filename):
+        return {}
+    with open(map_filename, 'rb') as f:
+        return pyarrow.deserialize(f.read())
+
+
+def save_maps(map_filename, maps):
+    out = pyarrow.OSFile(map_filename, 'wb')
+    out.write(pyarrow.serialize(maps).to_buffer())
+    out.close()
+
+
+def stream_pairs(infile, outfile, lang=None, map_filename=None, chunk_size=CHUNK_SIZE):
+    """Append the pairs of every tree of infile to outfile. Returns the
+    number of pairs written."""
+    if lang is None:
+        # vec/fast_algorithms.cpp.pkl
+        lang = os.path.splitext(os.path.splitext(infile)[0])[1][1:]
+    if map_filename is None:
+        map_filename = 'maps.%s.pa' % lang
+    maps = load_maps(map_filename)
+    known = len(maps)
+
+    node_counts = {}
+    writer = PairWriter(outfile, chunk_size)
+    try:
+        for trees, tree in enumerate(iter_trees(infile, lang), 1):
+            extract_pairs(tree, writer, maps, node_counts)
+            if trees % 1000 == 0:
+                print('%d trees, %d pairs' % (trees, writer.count + writer.size))
+    finally:
+        writer.close()
+
+    if len(maps) > known:
+        save_maps(map_filename, maps)
+        print('%d new kinds in %s' % (len(maps) - known, map_filename))
+    print('Total: %d pairs of %d kinds' % (writer.count, len(node_counts)))
+    return writer.count
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('inputs', help='merged pickle of trees, or the ast directory')
+    parser.add_argument('outfile', help='pairs file, appended to')
+    parser.add_argument('--lang', default=None,
+                        help='language of the trees, required for a directory (default: from the pickle name)')
+    parser.add_argument('--maps', default=None, help='kind vocabulary file (default: maps.LANG.pa)')
+    parser.add_argument('--chunk-size', type=int, default=CHUNK_SIZE, help='pairs written at a time')
+    args = parser.parse_args()
+    if os.path.isdir(args.inputs) and args.lang is None:
+        parser.error('--lang is required for a directory')
+
+    stream_pairs(args.inputs, args.outfile, args.lang, args.maps, args.chunk_size)
+
+
+if __name__ == "__main__":
+    main()
@@ -1,11 +1,26 @@
-"""Tuning hyperparameters for the ast2vec network."""
+"""Tuning hyperparameters for the ast2vec network. Every value can be
+overridden by an environment variable of the same name prefixed with
+AST2VEC_, e.g. AST2VEC_NUM_FEATURES=50, as sweep.py does for its trials."""
 
-NUM_FEATURES = 30
-BATCH_SIZE = 256
+import os
 
-EPOCHS = 100
 
-LEARN_RATE = 0.01
-HIDDEN_NODES = 100
+def _env(name, default):
+    value = os.environ.get('AST2VEC_' + name)
+    if value is None:
+        return default
+    if isinstance(default, int):
+        # sweep.py samples integers from continuous ranges too
+        return int(round(float(value)))
+    return type(default)(value)
 
-CHECKPOINT_EVERY = 1000
+
+NUM_FEATURES = _env('NUM_FEATURES', 30)
+BATCH_SIZE = _env('BATCH_SIZE', 256)
+
+EPOCHS = _env('EPOCHS', 100)
+
+LEARN_RATE = _env('LEARN_RATE', 0.01)
+HIDDEN_NODES = _env('HIDDEN_NODES', 100)
+
+CHECKPOINT_EVERY = _env('CHECKPOINT_EVERY', 1000)
@@ -1,6 +1,7 @@
 """Helper functions for sampling in ast2vec."""
 
 import ast
+import numpy as np
 from srcml_node_map import SRCML_NODE_MAP
 
 def batch_samples(samples, batch_size):
@@ -17,3 +18,16 @@ def batch_samples(samples, batch_size):
             if count >= batch_size:
                 yield batch
                 batch, count = ([], []), 0
+
+
+def load_pairs(path):
+    """The (node, parent) int32 rows of a fast_stream_nodes.py pairs file,
+    mapped from disk instead of read into memory."""
+    return np.memmap(path, dtype=np.int32, mode='r').reshape(-1, 2)
+
+
+def batch_pairs(pairs, batch_size):
+    """Same as batch_samples, for the rows of load_pairs."""
+    for start in range(0, len(pairs) - batch_size + 1, batch_size):
+        batch = pairs[start:start + batch_size]
+        yield batch[:, 0], batch[:, 1]
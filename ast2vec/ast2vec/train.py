@@ -3,6 +3,7 @@
 import os
 import logging
 import cPickle as pickle
+import numpy as np
 import tensorflow as tf
 import network
 import sampling
@@ -51,7 +52,10 @@ def learn_vectors(samples, logdir, outfile, num_feats=NUM_FEATURES, epochs=EPOCH
 
     step = 0
     for epoch in range(1, epochs+1):
-        sample_gen = sampling.batch_samples(samples, BATCH_SIZE)
+        if isinstance(samples, np.ndarray):
+            sample_gen = sampling.batch_pairs(samples, BATCH_SIZE)
+        else:
+            sample_gen = sampling.batch_samples(samples, BATCH_SIZE)
         for batch in sample_gen:
             input_batch, label_batch = batch
             # print label_batch
@@ -81,8 +85,12 @@ def learn_vectors(samples, logdir, outfile, num_feats=NUM_FEATURES, epochs=EPOCH
 
 def main():
 
-    with open(sys.argv[1], "rb") as sample_file:
-        samples = pickle.load(sample_file)
+    if sys.argv[1].endswith('.pairs'):
+        # written by fast_stream_nodes.py
+        samples = sampling.load_pairs(sys.argv[1])
+    else:
+        with open(sys.argv[1], "rb") as sample_file:
+            samples = pickle.load(sample_file)
     
     learn_vectors(samples, "vec", sys.argv[2])
 
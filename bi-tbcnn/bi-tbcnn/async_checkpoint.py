@@ -0,0 +1,163 @@
+"""Checkpointing that doesn't stall training.
+
+The variables are copied to host memory with one session run, and written
+to disk by a background thread from a separate graph, while training goes on.
+The files of a checkpoint are first written under a temporary name and
+renamed into place, the .index file last, before the `checkpoint` state file
+is updated; a crash at any point leaves the previous checkpoints intact.
+
+The checkpoints hold the same variable names as those written by
+tf.train.Saver in the training graph, so the usual restore logic applies.
+A trainer can store its own state (epoch, position in the epoch, seed) in a
+`.state` file next to every checkpoint, to resume exactly where it stopped."""
+
+import os
+import glob
+import time
+import pickle
+import threading
+import tensorflow as tf
+from parameters import CHECKPOINT_EVERY
+
+
+def add_arguments(parser):
+    """Add the checkpointing flags to a trainer's argument parser."""
+    group = parser.add_argument_group('checkpointing')
+    group.add_argument('--checkpoint-every', type=int, default=CHECKPOINT_EVERY,
+                       help='save every this many steps')
+    group.add_argument('--checkpoint-secs', type=float, default=None,
+                       help='save every this many seconds instead')
+    group.add_argument('--keep-checkpoints', type=int, default=5,
+                       help='number of latest checkpoints to keep')
+
+
+def options(args):
+    """AsyncCheckpointer keyword arguments from the flags of add_arguments."""
+    return {
+        'max_to_keep': args.keep_checkpoints,
+        'every_steps': args.checkpoint_every,
+        'every_secs': args.checkpoint_secs,
+    }
+
+
+def load_state(logdir):
+    """Return the trainer state stored with the latest checkpoint of logdir,
+    or None if there is no checkpoint or it was saved without state."""
+    ckpt = tf.train.get_checkpoint_state(logdir)
+    if not ckpt or not ckpt.model_checkpoint_path:
+        return None
+    path = ckpt.model_checkpoint_path + '.state'
+    if not os.path.isfile(path):
+        return None
+    with open(path, 'rb') as fh:
+        return pickle.load(fh)
+
+
+class AsyncCheckpointer(object):
+    """Saves the variables of sess to checkfile-STEP every every_steps steps,
+    or every every_secs seconds if given, keeping the max_to_keep latest.
+    Steps must increase from one save to the next."""
+
+    def __init__(self, sess, checkfile, max_to_keep=5, every_steps=CHECKPOINT_EVERY,
+                 every_secs=None, var_list=None):
+        self.sess = sess
+        self.checkfile = checkfile
+        self.logdir = os.path.dirname(checkfile)
+        self.max_to_keep = max_to_keep
+        self.every_steps = every_steps
+        self.every_secs = every_secs
+        self.variables = var_list if var_list is not None else tf.global_variables()
+        self.last_save = time.time()
+        self.last_step = None
+        self.thread = None
+        self.error = None
+
+        ckpt = tf.train.get_checkpoint_state(self.logdir)
+        self.kept = list(ckpt.all_model_checkpoint_paths) if ckpt else []
+
+        # a copy of every variable, saved under the name of the original
+        self.graph = tf.Graph()
+        with self.graph.as_default():
+            self.copies = [
+                tf.Variable(tf.zeros(var.get_shape(), dtype=var.dtype.base_dtype), trainable=False)
+                for var in self.variables
+            ]
+            self.saver = tf.train.Saver(
+                var_list={var.op.name: copy for var, copy in zip(self.variables, self.copies)},
+                max_to_keep=None,
+            )
+            self.writer_sess = tf.Session(config=tf.ConfigProto(
+                intra_op_parallelism_threads=1, inter_op_parallelism_threads=1))
+
+    def due(self, step):
+        if self.every_secs is not None:
+            return time.time() - self.last_save >= self.every_secs
+        return step % self.every_steps == 0
+
+    def maybe_save(self, step, state=None):
+        """Save if a checkpoint is due at step. Returns True if one was started."""
+        if not self.due(step):
+            return False
+        self.save(step, state)
+        return True
+
+    def save(self, step, state=None):
+        """Snapshot the variables now and write them in the background, with
+        state pickled next to them if given. Waits for the previous write, so
+        at most one snapshot is held in memory. The variables of a step
+        already saved are unchanged, only a newer state is written then."""
+        self.wait()
+        if step == self.last_step:
+            if state is not None:
+                self._write_state(self.checkfile + '-' + str(step), state)
+            return
+        values = self.sess.run(self.variables)
+        self.last_save = time.time()
+        self.last_step = step
+        self.thread = threading.Thread(target=self._write, args=(values, step, state))
+        self.thread.start()
+
+    def wait(self):
+        """Wait for the pending write, raising its error if it failed."""
+        if self.thread is not None:
+            self.thread.join()
+            self.thread = None
+        if self.error is not None:
+            error, self.error = self.error, None
+            raise error
+
+    def close(self):
+        self.wait()
+        self.writer_sess.close()
+
+    def _write_state(self, path, state):
+        tmp_path = os.path.join(self.logdir, '.tmp-' + os.path.basename(path) + '.state')
+        with open(tmp_path, 'wb') as fh:
+            pickle.dump(state, fh, pickle.HIGHEST_PROTOCOL)
+        os.rename(tmp_path, path + '.state')
+
+    def _write(self, values, step, state):
+        try:
+            for copy, value in zip(self.copies, values):
+                copy.load(value, self.writer_sess)
+            path = self.checkfile + '-' + str(step)
+            tmp_path = os.path.join(self.logdir, '.tmp-' + os.path.basename(path))
+            self.saver.save(self.writer_sess, tmp_path, write_meta_graph=False, write_state=False)
+            if state is not None:
+                with open(tmp_path + '.state', 'wb') as fh:
+                    pickle.dump(state, fh, pickle.HIGHEST_PROTOCOL)
+            tmp_files = glob.glob(tmp_path + '.*')
+            # the .index file makes the checkpoint readable, move it last
+            for tmp_file in sorted(tmp_files, key=lambda f: f.endswith('.index')):
+                os.rename(tmp_file, path + tmp_file[len(tmp_path):])
+
+            if path in self.kept:
+                self.kept.remove(path)
+            self.kept.append(path)
+            removed, self.kept = self.kept[:-self.max_to_keep], self.kept[-self.max_to_keep:]
+            tf.train.update_checkpoint_state(self.logdir, path, all_model_checkpoint_paths=self.kept)
+            for old in removed:
+                for old_file in glob.glob(old + '.*'):
+                    os.remove(old_file)
+        except Exception as e:
+            self.error = e
@@ -0,0 +1,190 @@
+"""Label every source file below a directory with a trained TBCNN model and
+stream one JSON line per file.
+
+Files are parsed with `fast` by a pool of worker processes while the previous
+window of files is being scored, so at most two windows of trees are held in
+memory at any time. Paths already present in the output file are skipped,
+which makes an interrupted run resumable by re-running the same command."""
+
+import os
+import json
+import time
+import argparse
+from itertools import islice
+from multiprocessing import Pool, cpu_count
+import numpy as np
+import fast_parser
+from parameters import INFERENCE_BATCH_SIZE
+
+# number of batches parsed ahead of the classifier
+WINDOW_BATCHES = 16
+
+
+def walk_sources(source_dir, language):
+    """Yield the source files of the given language below source_dir, in a
+    stable order."""
+    for root, dirs, files in os.walk(source_dir):
+        dirs.sort()
+        for name in sorted(files):
+            path = os.path.join(root, name)
+            if fast_parser.language_of(path) == language:
+                yield path
+
+
+def load_done(outfile):
+    """Return the paths already recorded in an existing output file."""
+    done = set()
+    if not os.path.isfile(outfile):
+        return done
+    with open(outfile, 'r') as fh:
+        for line in fh:
+            try:
+                done.add(json.loads(line)['path'])
+            except (ValueError, KeyError):
+                # a line cut short by an interrupted run, it will be redone
+                continue
+    return done
+
+
+def open_output(outfile):
+    """Open the output for appending, terminating a partially written last line."""
+    out = open(outfile, 'a+')
+    out.seek(0, os.SEEK_END)
+    if out.tell() > 0:
+        out.seek(out.tell() - 1)
+        if out.read(1) != '\n':
+            out.write('\n')
+    return out
+
+
+def timed_parse(path, parse, *args):
+    """Run parse(*args), returning (path, tree, num_nodes, error, seconds)."""
+    start = time.time()
+    try:
+        result = parse(*args)
+    except Exception as err:
+        return path, None, 0, str(err), time.time() - start
+    if result is None:
+        return path, None, 0, 'parse failed', time.time() - start
+    tree, num_nodes = result
+    return path, tree, num_nodes, None, time.time() - start
+
+
+def _parse(path):
+    """Worker: parse one file from disk."""
+    return timed_parse(path, fast_parser.parse_file, path)
+
+
+def classify_parsed(classifier, parsed, batch_size, max_nodes):
+    """Score a window of parsed files and return one record per file, in
+    the order they were parsed."""
+    records = []
+    scorable = []
+    for path, tree, num_nodes, error, seconds in parsed:
+        record = {'path': path, 'nodes': num_nodes, 'parse_ms': round(seconds * 1000, 3)}
+        if error is None and num_nodes > max_nodes:
+            error = 'tree too large'
+        if error is not None:
+            record['error'] = error
+        else:
+            scorable.append((record, tree))
+        records.append(record)
+
+    # batch trees of similar size together to keep padding small
+    scorable.sort(key=lambda x: x[0]['nodes'])
+    for i in range(0, len(scorable), batch_size):
+        batch = scorable[i:i + batch_size]
+        start = time.time()
+        probs = classifier.predict([tree for _, tree in batch], batch_size)
+        per_file_ms = (time.time() - start) * 1000 / len(batch)
+        for (record, _), p in zip(batch, probs):
+            record['label'] = classifier.labels[int(np.argmax(p))]
+            record['probabilities'] = {
+                label: round(float(x), 6) for label, x in zip(classifier.labels, p)
+            }
+            record['classify_ms'] = round(per_file_ms, 3)
+    return records
+
+
+def load_classifier(logdir, embedfile, infile=None, cache_dir=None, cache_mb=1024,
+                    int8_model=None):
+    """Restore the classifier, or load the int8 model written by
+    quantize_tbcnn.py, behind a tree hash cache if cache_dir is given."""
+    if int8_model is not None:
+        from quantization import QuantizedClassifier
+        classifier = QuantizedClassifier(int8_model, embedfile)
+    else:
+        from inference import TreeClassifier, load_labels
+        classifier = TreeClassifier(logdir, embedfile, load_labels(logdir, infile))
+    if cache_dir is None:
+        return classifier
+    from tree_cache import TreeCache, CachedClassifier
+    return CachedClassifier(classifier, TreeCache(cache_dir, cache_mb * 1024 * 1024))
+
+
+def report_cache(classifier):
+    if hasattr(classifier, 'cache'):
+        print('Cache: ' + json.dumps(classifier.cache.stats(), sort_keys=True))
+
+
+def classify_directory(logdir, embedfile, source_dir, outfile, language,
+                       infile=None, workers=None, batch_size=INFERENCE_BATCH_SIZE,
+                       max_nodes=10000, cache_dir=None, cache_mb=1024, int8_model=None):
+    """Classify all files of one language below source_dir into outfile."""
+    # fork the parser pool before tensorflow starts its threads
+    workers = workers or cpu_count()
+    pool = Pool(workers)
+
+    classifier = load_classifier(logdir, embedfile, infile, cache_dir, cache_mb, int8_model)
+
+    done = load_done(outfile)
+    print('Skipping ' + str(len(done)) + ' files already in ' + outfile)
+    paths = (p for p in walk_sources(source_dir, language) if p not in done)
+    window = batch_size * WINDOW_BATCHES
+
+    out = open_output(outfile)
+    total = 0
+    start = time.time()
+    chunk = list(islice(paths, window))
+    pending = pool.map_async(_parse, chunk, 1) if chunk else None
+    while pending is not None:
+        parsed = pending.get()
+        chunk = list(islice(paths, window))
+        pending = pool.map_async(_parse, chunk, 1) if chunk else None
+
+        for record in classify_parsed(classifier, parsed, batch_size, max_nodes):
+            out.write(json.dumps(record, sort_keys=True) + '\n')
+        out.flush()
+        total += len(parsed)
+        print('Classified ' + str(total) + ' files, ' +
+              str(round(total / (time.time() - start), 2)) + ' files/sec')
+
+    out.close()
+    pool.close()
+    pool.join()
+    report_cache(classifier)
+    classifier.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir', help='directory holding the train_tbcnn.py checkpoints')
+    parser.add_argument('embeddings', help='pretrained node vectors of the language')
+    parser.add_argument('source_dir', help='directory to classify')
+    parser.add_argument('outfile', help='JSON lines output, appended to when resuming')
+    parser.add_argument('--language', default='cpp', choices=sorted(set(fast_parser.LANGUAGE_EXTENSIONS.values())))
+    parser.add_argument('--trees', default=None, help='training trees pickle, to read the labels of older models')
+    parser.add_argument('--workers', type=int, default=None)
+    parser.add_argument('--batch-size', type=int, default=INFERENCE_BATCH_SIZE)
+    parser.add_argument('--max-nodes', type=int, default=10000)
+    parser.add_argument('--cache-dir', default=None, help='tree hash cache of this model')
+    parser.add_argument('--cache-mb', type=int, default=1024, help='size bound of the cache')
+    parser.add_argument('--int8', default=None, help='int8 model written by quantize_tbcnn.py')
+    args = parser.parse_args()
+
+    classify_directory(args.logdir, args.embeddings, args.source_dir, args.outfile,
+                       args.language, args.trees, args.workers, args.batch_size,
+                       args.max_nodes, args.cache_dir, args.cache_mb, args.int8)
+
+if __name__ == "__main__":
+    main()
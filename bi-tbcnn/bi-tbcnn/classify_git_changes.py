@@ -0,0 +1,174 @@
+"""Re-classify a git repository after a change, re-parsing only the files that
+differ between two revisions.
+
+Results are persisted in a store keyed by git blob id, so a file whose
+content was already scored (in any earlier revision, under any path) is never
+parsed again. Only the files of `git diff --name-only` are scored; every
+other file of the new revision is answered from the store, and left out of
+the output if the store doesn't have it. The first run on a repository
+takes --full to score every file. The output lists one JSON line per file
+of the new revision found in the store."""
+
+import os
+import json
+import time
+import shelve
+import argparse
+import subprocess
+from multiprocessing import Pool, cpu_count
+import fast_parser
+import classify_directory
+from parameters import INFERENCE_BATCH_SIZE
+
+
+def git(repo, *args):
+    return subprocess.check_output(['git', '-C', repo] + list(args))
+
+
+def list_blobs(repo, rev, language):
+    """Return [(path, blob id)] of every file of the language in rev."""
+    blobs = []
+    for entry in git(repo, 'ls-tree', '-r', '-z', rev).decode('utf-8').split('\0'):
+        if not entry:
+            continue
+        meta, path = entry.split('\t', 1)
+        _, kind, sha = meta.split()
+        if kind == 'blob' and fast_parser.language_of(path) == language:
+            blobs.append((path, str(sha)))
+    return blobs
+
+
+def changed_paths(repo, old_rev, new_rev):
+    """Return the set of paths that differ between two revisions."""
+    out = git(repo, 'diff', '--name-only', '-z', old_rev, new_rev).decode('utf-8')
+    return set(p for p in out.split('\0') if p)
+
+
+def read_blobs(repo, shas):
+    """Return the contents of the given blobs with a single `git cat-file` process."""
+    proc = subprocess.Popen(['git', '-C', repo, 'cat-file', '--batch'],
+                            stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    contents = []
+    for sha in shas:
+        proc.stdin.write((sha + '\n').encode('ascii'))
+        proc.stdin.flush()
+        header = proc.stdout.readline().split()
+        # "<sha> missing" instead of "<sha> <type> <size>"
+        if len(header) != 3:
+            proc.kill()
+            proc.wait()
+            raise IOError('Blob ' + sha + ' not found in ' + repo + ': ' + b' '.join(header).decode('utf-8'))
+        size = int(header[2])
+        contents.append(proc.stdout.read(size))
+        proc.stdout.read(1)  # trailing newline
+    proc.stdin.close()
+    proc.wait()
+    return contents
+
+
+def _parse_blob(item):
+    """Worker: parse one blob held in memory."""
+    path, content = item
+    return classify_directory.timed_parse(
+        path, fast_parser.parse_source, content, os.path.splitext(path)[1]
+    )
+
+
+def classify_changes(logdir, embedfile, repo, old_rev, new_rev, store_path, outfile,
+                     language, infile=None, workers=None,
+                     batch_size=INFERENCE_BATCH_SIZE, max_nodes=10000,
+                     cache_dir=None, cache_mb=1024, int8_model=None, full=False):
+    """Classify the files of the language changed between old_rev and
+    new_rev (all of them with full) whose blobs are missing from the store,
+    and write the results of every file of new_rev into outfile."""
+    start = time.time()
+    blobs = list_blobs(repo, new_rev, language)
+    changed = changed_paths(repo, old_rev, new_rev)
+    store = shelve.open(store_path)
+
+    # identical files share a blob, score each blob once
+    todo = []
+    queued = set()
+    missing = 0
+    for path, sha in blobs:
+        if sha in store or sha in queued:
+            continue
+        if full or path in changed:
+            queued.add(sha)
+            todo.append((path, sha))
+        else:
+            missing += 1
+    if missing:
+        print('Warning: ' + str(missing) + ' unchanged files are missing from the store and left out, '
+              'run once with --full to score them')
+
+    if todo:
+        # fork the parser pool before tensorflow starts its threads
+        pool = Pool(workers or cpu_count())
+        classifier = classify_directory.load_classifier(
+            logdir, embedfile, infile, cache_dir, cache_mb, int8_model)
+
+        window = batch_size * classify_directory.WINDOW_BATCHES
+        for i in range(0, len(todo), window):
+            chunk = todo[i:i + window]
+            contents = read_blobs(repo, [sha for _, sha in chunk])
+            parsed = pool.map(_parse_blob, zip([path for path, _ in chunk], contents), 1)
+            records = classify_directory.classify_parsed(classifier, parsed, batch_size, max_nodes)
+            for (path, sha), record in zip(chunk, records):
+                # a blob's result doesn't depend on where it lives
+                del record['path']
+                if record.get('error') not in (None, 'parse failed', 'tree too large'):
+                    # an environment failure (e.g. no `fast` binary), retry next time
+                    print('Error on ' + path + ': ' + record['error'])
+                    continue
+                store[sha] = record
+            store.sync()
+
+        pool.close()
+        pool.join()
+        classify_directory.report_cache(classifier)
+        classifier.close()
+
+    with open(outfile, 'w') as out:
+        for path, sha in blobs:
+            if sha not in store:
+                continue
+            record = dict(store[sha])
+            record['path'] = path
+            record['blob'] = sha
+            out.write(json.dumps(record, sort_keys=True) + '\n')
+    store.close()
+
+    print('Files: ' + str(len(blobs)) + ', changed: ' + str(len(changed)) +
+          ', blobs scored: ' + str(len(todo)) +
+          ', seconds: ' + str(round(time.time() - start, 2)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir', help='directory holding the train_tbcnn.py checkpoints')
+    parser.add_argument('embeddings', help='pretrained node vectors of the language')
+    parser.add_argument('repo', help='git repository to classify')
+    parser.add_argument('old_rev')
+    parser.add_argument('new_rev')
+    parser.add_argument('store', help='results store of this model, created on first use')
+    parser.add_argument('outfile', help='JSON lines output for new_rev')
+    parser.add_argument('--language', default='cpp', choices=sorted(set(fast_parser.LANGUAGE_EXTENSIONS.values())))
+    parser.add_argument('--trees', default=None, help='training trees pickle, to read the labels of older models')
+    parser.add_argument('--workers', type=int, default=None)
+    parser.add_argument('--batch-size', type=int, default=INFERENCE_BATCH_SIZE)
+    parser.add_argument('--max-nodes', type=int, default=10000)
+    parser.add_argument('--cache-dir', default=None, help='tree hash cache of this model')
+    parser.add_argument('--cache-mb', type=int, default=1024, help='size bound of the cache')
+    parser.add_argument('--int8', default=None, help='int8 model written by quantize_tbcnn.py')
+    parser.add_argument('--full', action='store_true',
+                        help='also score the unchanged files missing from the store, e.g. on the first run')
+    args = parser.parse_args()
+
+    classify_changes(args.logdir, args.embeddings, args.repo, args.old_rev, args.new_rev,
+                     args.store, args.outfile, args.language, args.trees, args.workers,
+                     args.batch_size, args.max_nodes, args.cache_dir, args.cache_mb,
+                     args.int8, args.full)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,155 @@
+"""k-fold cross-validation of the TBCNN of train_tbcnn.py.
+
+The training and test trees of a trees pickle are split into k
+label-stratified folds, written as a manifest of tree indices to
+OUTDIR/folds.json (see folds.py); the same --seed always gives the same
+folds. Every fold trains a TBCNN in OUTDIR/fold-I on the other folds and
+tests it on its own trees. The folds run concurrently, each pinned to its
+own --cores-per-fold cores, and all read the same pickle.
+
+The accuracy of every fold and their mean and standard deviation, the summed
+confusion matrix and the standard deviation of each of its cells over the
+folds are printed and written to OUTDIR/summary.json. Arguments after -- are
+passed on to train_tbcnn.py, e.g. -- --eval-every 5."""
+
+import os
+import sys
+import json
+import time
+import pickle
+import argparse
+import numpy as np
+import folds as folds
+import sweep as sweep
+
+
+def write_folds(infile, outdir, k, seed):
+    """Write the folds manifest of the trees of infile and return its path."""
+    with open(infile, 'rb') as fh:
+        trees, test_trees, _ = pickle.load(fh)
+    corpus = folds.corpus(trees, test_trees)
+    fold_indices = folds.make_folds([tree['label'] for tree in corpus], k, seed)
+    manifest = os.path.join(outdir, 'folds.json')
+    folds.save_manifest(manifest, infile, fold_indices, seed)
+    print('%d trees in %d folds of %s trees' % (len(corpus), k, ', '.join(str(len(f)) for f in fold_indices)))
+    return manifest
+
+
+def fold_command(fold, logdir, infile, embedfile, manifest, extra_args):
+    trainer = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'train_tbcnn.py')
+    return [sys.executable, trainer, logdir, infile, embedfile, 'True', 'True',
+            '--folds', manifest, '--fold', str(fold),
+            '--results', os.path.join(logdir, 'results.json')] + list(extra_args)
+
+
+def run_folds(commands, logdirs, cores_per_fold, parallel=None, memory_mb=None, poll_secs=5):
+    """Run the command of every fold, as many at a time as there are slots
+    of cores. Returns the exit status of every fold."""
+    slots = sweep.core_slots(cores_per_fold, parallel)
+    pending = list(range(len(commands)))
+    running = {}
+    status = [None] * len(commands)
+    try:
+        while pending or running:
+            while pending and slots:
+                fold = pending.pop(0)
+                cores = slots.pop(0)
+                print('Fold %d on cores %s' % (fold, ','.join(str(c) for c in cores)))
+                running[fold] = (sweep.launch(commands[fold], cores, os.path.join(logdirs[fold], 'log.txt'),
+                                              memory_mb=memory_mb), cores, time.time())
+            time.sleep(poll_secs)
+            for fold, (process, cores, start) in list(running.items()):
+                if process.poll() is not None:
+                    status[fold] = process.returncode
+                    slots.append(cores)
+                    del running[fold]
+                    print('Fold %d exited with %d after %.0f seconds' % (fold, process.returncode, time.time() - start))
+    finally:
+        for process, _, _ in running.values():
+            process.terminate()
+    return status
+
+
+def aggregate(results):
+    """Summary of the results.json of the folds."""
+    accuracies = np.array([r['accuracy'] for r in results])
+    confusions = np.array([r['confusion'] for r in results], dtype=np.float64)
+    # the recall of every label in every fold, nan where a fold has none of it
+    with np.errstate(invalid='ignore', divide='ignore'):
+        recalls = np.diagonal(confusions, axis1=1, axis2=2) / confusions.sum(axis=2)
+    return {
+        'labels': results[0]['labels'],
+        'folds': len(results),
+        'accuracies': accuracies.tolist(),
+        'accuracy_mean': float(accuracies.mean()),
+        'accuracy_std': float(accuracies.std(ddof=1)) if len(results) > 1 else 0.0,
+        'confusion': confusions.sum(axis=0).astype(np.int64).tolist(),
+        'confusion_std': (confusions.std(axis=0, ddof=1) if len(results) > 1
+                          else np.zeros_like(confusions[0])).tolist(),
+        'recall_mean': np.nan_to_num(np.nanmean(recalls, axis=0)).tolist(),
+    }
+
+
+def print_summary(summary):
+    print('Accuracy of the folds: ' + ', '.join('%.4f' % a for a in summary['accuracies']))
+    print('Accuracy: %.4f +/- %.4f' % (summary['accuracy_mean'], summary['accuracy_std']))
+    width = max(len(str(label)) for label in summary['labels'])
+    print('Confusion matrix over all folds (rows: true labels), recall:')
+    for label, row, recall in zip(summary['labels'], summary['confusion'], summary['recall_mean']):
+        print(str(label).ljust(width) + ' ' + ' '.join('%5d' % count for count in row) + '   %.3f' % recall)
+
+
+def cross_validate(infile, embedfile, outdir, k=5, seed=0, cores_per_fold=1, parallel=None, memory_mb=None,
+                   extra_args=(), poll_secs=5):
+    if not os.path.isdir(outdir):
+        os.makedirs(outdir)
+    manifest = write_folds(infile, outdir, k, seed)
+    logdirs = [os.path.join(outdir, 'fold-%d' % fold) for fold in range(k)]
+    for logdir in logdirs:
+        if not os.path.isdir(logdir):
+            os.makedirs(logdir)
+    commands = [fold_command(fold, logdirs[fold], infile, embedfile, manifest, extra_args) for fold in range(k)]
+    status = run_folds(commands, logdirs, cores_per_fold, parallel, memory_mb, poll_secs)
+
+    results = []
+    for fold, logdir in enumerate(logdirs):
+        path = os.path.join(logdir, 'results.json')
+        if status[fold] != 0 or not os.path.isfile(path):
+            print('Fold %d failed, see %s' % (fold, os.path.join(logdir, 'log.txt')))
+            continue
+        with open(path) as fh:
+            results.append(json.load(fh))
+    if not results:
+        raise RuntimeError('No fold finished')
+    summary = aggregate(results)
+    with open(os.path.join(outdir, 'summary.json'), 'w') as fh:
+        json.dump(summary, fh, indent=2)
+    print_summary(summary)
+    return summary
+
+
+def main():
+    argv = sys.argv[1:]
+    extra_args = []
+    if '--' in argv:
+        extra_args = argv[argv.index('--') + 1:]
+        argv = argv[:argv.index('--')]
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('inputs', help='trees pickle')
+    parser.add_argument('embeddings')
+    parser.add_argument('outdir', help='directory of the folds manifest, the fold models and the summary')
+    parser.add_argument('--k', type=int, default=5, help='number of folds')
+    parser.add_argument('--seed', type=int, default=0, help='seed of the folds')
+    parser.add_argument('--cores-per-fold', type=int, default=1)
+    parser.add_argument('--parallel', type=int, default=None,
+                        help='most folds at a time, by default as many as the cores allow')
+    parser.add_argument('--memory-mb', type=int, default=None, help='limit the memory of every fold')
+    parser.add_argument('--poll-secs', type=float, default=5)
+    args = parser.parse_args(argv)
+
+    cross_validate(args.inputs, args.embeddings, args.outdir, args.k, args.seed, args.cores_per_fold,
+                   args.parallel, args.memory_mb, extra_args, args.poll_secs)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,85 @@
+"""Train on small trees first.
+
+An untrained model learns as much from a 100 node tree as from a 10000 node
+one, at a hundredth of the cost. With a curriculum, an epoch only trains on
+the given fraction of its smallest samples (trees, or pairs by their total
+size), and that fraction widens until every sample is used:
+
+- 'epochs' widens it linearly from --curriculum-start to all samples over
+  --curriculum-epochs epochs,
+- 'loss' widens it by the same amount after every epoch whose mean loss is
+  below --curriculum-loss.
+
+The samples kept are a fixed fraction of every worker's samples, so all
+workers of data-parallel training run the same number of steps."""
+
+import math
+
+
+def add_arguments(parser):
+    """Add the curriculum flags to a trainer's argument parser."""
+    group = parser.add_argument_group('curriculum')
+    group.add_argument('--curriculum', default=None, choices=['epochs', 'loss'],
+                       help='start with the smallest samples and widen on a schedule of epochs or loss')
+    group.add_argument('--curriculum-start', type=float, default=0.25,
+                       help='fraction of the samples, smallest first, trained on at first')
+    group.add_argument('--curriculum-epochs', type=int, default=5,
+                       help='number of epochs, or of widenings, until all samples are used')
+    group.add_argument('--curriculum-loss', type=float, default=0.5,
+                       help="with 'loss', widen after an epoch of mean loss below this")
+
+
+def options(args):
+    """Curriculum keyword arguments from the flags of add_arguments."""
+    return {
+        'schedule': args.curriculum,
+        'start': args.curriculum_start,
+        'epochs': args.curriculum_epochs,
+        'loss': args.curriculum_loss,
+    }
+
+
+class Curriculum(object):
+    """Selects the samples of every epoch. With schedule None every sample
+    is used. fraction restores the state of a 'loss' schedule, see state()."""
+
+    def __init__(self, schedule=None, start=0.25, epochs=5, loss=0.5, fraction=None):
+        self.schedule = schedule
+        self.start = start
+        self.epochs = max(1, epochs)
+        self.loss = loss
+        self.fraction = start if fraction is None else fraction
+
+    def fraction_at(self, epoch):
+        """Fraction of the samples trained on in epoch (counted from 1)."""
+        if self.schedule is None:
+            return 1.0
+        if self.schedule == 'epochs':
+            return min(1.0, self.start + (1.0 - self.start) * (epoch - 1) / self.epochs)
+        return self.fraction
+
+    def select(self, sizes, epoch):
+        """Indices of the samples to train on in epoch, in their original
+        order. sizes holds the number of nodes of every sample, or a tuple
+        of them for pairs."""
+        fraction = self.fraction_at(epoch)
+        if fraction >= 1.0:
+            return list(range(len(sizes)))
+        keep = int(math.ceil(fraction * len(sizes)))
+        by_size = sorted(range(len(sizes)), key=lambda i: (_total(sizes[i]), i))
+        return sorted(by_size[:keep])
+
+    def end_epoch(self, mean_loss):
+        """Widen a 'loss' schedule if mean_loss, the mean loss of the epoch
+        over all workers, is low enough. Returns True if it widened."""
+        if self.schedule != 'loss' or self.fraction >= 1.0 or mean_loss >= self.loss:
+            return False
+        self.fraction = min(1.0, self.fraction + (1.0 - self.start) / self.epochs)
+        return True
+
+    def state(self):
+        return self.fraction
+
+
+def _total(size):
+    return sum(size) if isinstance(size, tuple) else size
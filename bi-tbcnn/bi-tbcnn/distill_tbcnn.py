@@ -0,0 +1,166 @@
+"""Distill a TBCNN classifier trained by train_tbcnn.py into a smaller student.
+
+The student learns from the soft labels of the teacher on the training
+trees, along with their true labels. It can have fewer convolution outputs,
+node kind embeddings reduced to their first principal components and trees
+cut at a maximum depth, all of which make it faster. The student is written
+as a normal checkpoint directory, which inference.TreeClassifier (and so
+classify_directory.py) loads like a TBCNN.
+
+After training, the teacher and the student classify the test trees, and
+their accuracy and speed are printed and appended as a JSON line to
+--report, to collect the trade-off points of several students."""
+
+import os
+import json
+import random
+import pickle
+import argparse
+import numpy as np
+import tensorflow as tf
+import network as network
+import sampling as sampling
+import inference as inference
+from quantize_tbcnn import timed_predictions, print_comparison
+from parameters import LEARN_RATE, BATCH_SIZE, INFERENCE_BATCH_SIZE
+
+
+def reduce_embeddings(embeddings, size):
+    """Project the embeddings on their size first principal components."""
+    embeddings = np.asarray(embeddings, dtype=np.float32)
+    if not size or size >= embeddings.shape[1]:
+        return embeddings
+    centered = embeddings - embeddings.mean(axis=0)
+    _, _, components = np.linalg.svd(centered, full_matrices=False)
+    return centered.dot(components[:size].T).astype(np.float32)
+
+
+def soft_labels(probs, temperature):
+    """The softmax of the teacher logits at temperature, from its softmax at
+    temperature 1."""
+    logits = np.log(np.maximum(probs, 1e-12)) / temperature
+    logits -= logits.max(axis=1, keepdims=True)
+    exp = np.exp(logits)
+    return exp / exp.sum(axis=1, keepdims=True)
+
+
+def train_student(student_logdir, trees, targets, labels, embeddings, embed_lookup, conv_size,
+                  temperature, alpha, epochs, batch_size):
+    """Train the student on trees and the soft labels targets of the teacher
+    and write its checkpoint to student_logdir."""
+    graph = tf.Graph()
+    with graph.as_default():
+        nodes_node, children_node, _, hidden_node = network.init_net_with_pooling(
+            len(embeddings[0]), len(labels), conv_size)
+        labels_node, soft_labels_node, loss_node = network.distillation_loss_layer(
+            hidden_node, len(labels), temperature, alpha)
+        train_step = tf.train.AdamOptimizer(LEARN_RATE).minimize(loss_node)
+
+        sess = tf.Session()
+        sess.run(tf.global_variables_initializer())
+        order = list(range(len(trees)))
+        for epoch in range(1, epochs + 1):
+            random.shuffle(order)
+            losses = []
+            for start in range(0, len(order), batch_size):
+                batch = order[start:start + batch_size]
+                nodes, children, batch_labels, counts = next(sampling.batch_samples(
+                    sampling.gen_samples([trees[i] for i in batch], labels, embeddings, embed_lookup),
+                    len(batch)
+                ))
+                _, err = sess.run([train_step, loss_node], feed_dict={
+                    nodes_node: nodes,
+                    children_node: children,
+                    network.node_counts(nodes_node): counts,
+                    labels_node: batch_labels,
+                    soft_labels_node: targets[batch],
+                })
+                losses.append(err)
+            print('Epoch:', epoch, 'Loss:', np.mean(losses))
+
+        if not os.path.isdir(student_logdir):
+            os.makedirs(student_logdir)
+        tf.train.Saver().save(sess, os.path.join(student_logdir, 'cnn_tree.ckpt'), global_step=epochs)
+        sess.close()
+
+
+def distill(teacher_logdir, embedfile, infile, student_logdir, conv_size=32, embedding_size=None,
+            max_depth=None, temperature=2.0, alpha=0.5, epochs=10, batch_size=BATCH_SIZE,
+            report=None, evaluate=True):
+    with open(infile, 'rb') as fh:
+        trees, test_trees, _ = pickle.load(fh)
+    labels = inference.load_labels(teacher_logdir, infile)
+    with open(embedfile, 'rb') as fh:
+        embeddings, embed_lookup = pickle.load(fh)
+
+    print('Computing the soft labels of ' + str(len(trees)) + ' training trees...')
+    teacher = inference.TreeClassifier(teacher_logdir, embedfile, labels)
+    targets = soft_labels(teacher.predict([t['tree'] for t in trees], INFERENCE_BATCH_SIZE), temperature)
+
+    student_embeddings = reduce_embeddings(embeddings, embedding_size)
+    student_trees = trees
+    if max_depth is not None:
+        student_trees = [{'tree': sampling.cap_depth(t['tree'], max_depth), 'label': t['label']}
+                         for t in trees]
+    train_student(student_logdir, student_trees, targets, labels, student_embeddings, embed_lookup,
+                  conv_size, temperature, alpha, epochs, batch_size)
+    inference.save_labels(student_logdir, labels)
+    inference.save_student(student_logdir, conv_size, student_embeddings, max_depth)
+    print('Student written to ' + student_logdir)
+
+    if not evaluate:
+        teacher.close()
+        return
+
+    test = [t['tree'] for t in test_trees]
+    label_index = {label: i for i, label in enumerate(labels)}
+    correct_labels = [label_index[t['label']] for t in test_trees]
+    teacher_results = timed_predictions(lambda x: teacher.predict(x, INFERENCE_BATCH_SIZE), test)
+    teacher.close()
+    student = inference.TreeClassifier(student_logdir, embedfile, labels)
+    student_results = timed_predictions(lambda x: student.predict(x, INFERENCE_BATCH_SIZE), test)
+    student.close()
+
+    print_comparison(labels, correct_labels, [
+        ('teacher', teacher_results[0], teacher_results[1]),
+        ('student', student_results[0], student_results[1]),
+    ])
+    if report is not None:
+        with open(report, 'a') as fh:
+            for name, logdir, (predictions, speed) in [('teacher', teacher_logdir, teacher_results),
+                                                       ('student', student_logdir, student_results)]:
+                fh.write(json.dumps({
+                    'model': name, 'logdir': logdir,
+                    'conv_size': conv_size if name == 'student' else 100,
+                    'embedding_size': len(student_embeddings[0]) if name == 'student' else len(embeddings[0]),
+                    'max_depth': max_depth if name == 'student' else None,
+                    'accuracy': float(np.mean(np.equal(predictions, correct_labels))),
+                    'trees_per_sec': speed,
+                }, sort_keys=True) + '\n')
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('teacher_logdir', help='directory holding the train_tbcnn.py checkpoints')
+    parser.add_argument('embeddings')
+    parser.add_argument('trees', help='training trees pickle')
+    parser.add_argument('student_logdir', help='directory to write the student to')
+    parser.add_argument('--conv-size', type=int, default=32, help='convolution outputs of the student')
+    parser.add_argument('--embedding-size', type=int, default=None,
+                        help='reduce the node kind embeddings to this many dimensions')
+    parser.add_argument('--max-depth', type=int, default=None, help='cut the trees at this depth')
+    parser.add_argument('--temperature', type=float, default=2.0)
+    parser.add_argument('--alpha', type=float, default=0.5, help='weight of the true labels in the loss')
+    parser.add_argument('--epochs', type=int, default=10)
+    parser.add_argument('--batch-size', type=int, default=BATCH_SIZE)
+    parser.add_argument('--report', default=None, metavar='FILE',
+                        help='append the accuracy and speed of the teacher and student to FILE')
+    parser.add_argument('--no-eval', action='store_true')
+    args = parser.parse_args()
+
+    distill(args.teacher_logdir, args.embeddings, args.trees, args.student_logdir, args.conv_size,
+            args.embedding_size, args.max_depth, args.temperature, args.alpha, args.epochs,
+            args.batch_size, args.report, not args.no_eval)
+
+if __name__ == "__main__":
+    main()
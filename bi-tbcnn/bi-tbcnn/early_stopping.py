@@ -0,0 +1,107 @@
+"""Stop training once the validation accuracy stops improving.
+
+The trainers measure the accuracy every --eval-every epochs, on a slice of
+the training trees (or pairs) held out with --validation, or else on the
+test trees (or --eval-pairs). Every evaluation that beats the best accuracy
+so far by --min-delta saves the model to LOGDIR/best, a normal checkpoint
+directory; after --patience evaluations without one, training stops.
+
+With data-parallel training the chief evaluates and all workers stop
+together."""
+
+import os
+import numpy as np
+import async_checkpoint as async_checkpoint
+
+BEST_DIR = 'best'
+
+
+def add_arguments(parser):
+    """Add the early stopping flags to a trainer's argument parser."""
+    group = parser.add_argument_group('early stopping')
+    group.add_argument('--validation', type=float, default=0.0, metavar='FRACTION',
+                       help='hold out this fraction of the training samples to evaluate on')
+    group.add_argument('--patience', type=int, default=0,
+                       help='stop after this many evaluations without improvement, 0 to never stop')
+    group.add_argument('--min-delta', type=float, default=0.0,
+                       help='smallest gain of accuracy that counts as an improvement')
+    group.add_argument('--keep-best', action='store_true',
+                       help='save the best model to LOGDIR/best, also without --patience')
+
+
+def options(args):
+    """EarlyStopping keyword arguments from the flags of add_arguments."""
+    return {
+        'validation': args.validation,
+        'patience': args.patience,
+        'min_delta': args.min_delta,
+        'keep_best': args.keep_best or args.patience > 0,
+    }
+
+
+def split_validation(samples, fraction, seed=0):
+    """Split samples into the samples to train on and a held-out fraction of
+    them, the same ones for the same seed."""
+    if not fraction:
+        return samples, []
+    order = np.random.RandomState(seed).permutation(len(samples))
+    held_out = set(order[:int(round(fraction * len(samples)))].tolist())
+    return ([s for i, s in enumerate(samples) if i not in held_out],
+            [s for i, s in enumerate(samples) if i in held_out])
+
+
+class EarlyStopping(object):
+    """Tracks the best accuracy of the evaluations and saves the model of
+    sess to logdir/best when it improves, if keep_best. best and bad_evals
+    restore the state of a resumed run, see state()."""
+
+    def __init__(self, sess, logdir, validation=0.0, patience=0, min_delta=0.0, keep_best=False,
+                 best=None, best_epoch=None, bad_evals=0):
+        self.validation = validation
+        self.patience = patience
+        self.min_delta = min_delta
+        self.best = best
+        self.best_epoch = best_epoch
+        self.bad_evals = bad_evals
+        self.best_dir = os.path.join(logdir, BEST_DIR)
+        self.checkpointer = None
+        if keep_best and sess is not None:
+            if not os.path.isdir(self.best_dir):
+                os.makedirs(self.best_dir)
+            self.checkpointer = async_checkpoint.AsyncCheckpointer(
+                sess, os.path.join(self.best_dir, 'cnn_tree.ckpt'), max_to_keep=1)
+
+    def update(self, epoch, step, accuracy):
+        """Record the accuracy after epoch, at step. Returns True if it is
+        the best so far."""
+        if self.best is not None and accuracy < self.best + self.min_delta:
+            self.bad_evals += 1
+            return False
+        self.best, self.best_epoch, self.bad_evals = accuracy, epoch, 0
+        if self.checkpointer is not None:
+            self.checkpointer.save(step)
+        return True
+
+    @property
+    def should_stop(self):
+        return self.patience > 0 and self.bad_evals >= self.patience
+
+    def state(self):
+        return {'best': self.best, 'best_epoch': self.best_epoch, 'bad_evals': self.bad_evals}
+
+    def report(self):
+        if self.best is None:
+            return
+        print('Best accuracy %.4f after epoch %d' % (self.best, self.best_epoch)
+              + (', saved in ' + self.best_dir if self.checkpointer is not None else ''))
+
+    def close(self):
+        if self.checkpointer is not None:
+            self.checkpointer.close()
+
+
+def agree(comm, stop):
+    """The stop decision of the chief, on every worker."""
+    if comm is None:
+        return stop
+    return bool(comm.broadcast([np.array([float(stop)], dtype=np.float32)])[0][0])
@@ -0,0 +1,58 @@
+"""Write the pooled vectors of the Bi-TBCNN towers for every tree of the left
+and right languages, in the `label v1 v2 ...` text format of test_vectors/.
+Each tower has its own space, so the left and right files are searched
+separately (see vector_index.py)."""
+
+import pickle
+import argparse
+from inference import BiTreeEncoder
+from parameters import INFERENCE_BATCH_SIZE
+
+
+def load_trees(infile, split):
+    """Load the train, test or all trees of a fast_algorithms_trees pickle."""
+    with open(infile, 'rb') as fh:
+        train_trees, test_trees, _ = pickle.load(fh)
+    if split == 'train':
+        return train_trees
+    if split == 'test':
+        return test_trees
+    return train_trees + test_trees
+
+
+def write_vectors(outfile, trees, vectors):
+    with open(outfile, 'w') as fh:
+        for tree, vector in zip(trees, vectors):
+            fh.write(tree['label'] + ' ' + ' '.join('%g' % x for x in vector) + '\n')
+
+
+def export_vectors(logdir, left_embedfile, right_embedfile, left_infile, right_infile,
+                   left_outfile, right_outfile, split='test', batch_size=INFERENCE_BATCH_SIZE):
+    encoder = BiTreeEncoder(logdir, left_embedfile, right_embedfile)
+    for side, infile, outfile in [('left', left_infile, left_outfile),
+                                  ('right', right_infile, right_outfile)]:
+        trees = load_trees(infile, split)
+        print('Encoding ' + str(len(trees)) + ' ' + side + ' trees...')
+        write_vectors(outfile, trees, encoder.encode([t['tree'] for t in trees], side, batch_size))
+    encoder.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir', help='directory holding the train_bitbcnn.py checkpoints')
+    parser.add_argument('left_embeddings')
+    parser.add_argument('right_embeddings')
+    parser.add_argument('left_trees', help='e.g. vec/fast_algorithms_trees_cpp.pkl')
+    parser.add_argument('right_trees', help='e.g. vec/fast_algorithms_trees_java.pkl')
+    parser.add_argument('left_outfile')
+    parser.add_argument('right_outfile')
+    parser.add_argument('--split', default='test', choices=['train', 'test', 'all'])
+    parser.add_argument('--batch-size', type=int, default=INFERENCE_BATCH_SIZE)
+    args = parser.parse_args()
+
+    export_vectors(args.logdir, args.left_embeddings, args.right_embeddings,
+                   args.left_trees, args.right_trees, args.left_outfile,
+                   args.right_outfile, args.split, args.batch_size)
+
+if __name__ == "__main__":
+    main()
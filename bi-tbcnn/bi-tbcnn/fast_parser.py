@@ -0,0 +1,60 @@
+"""Parse source files into the tree format used by the TBCNN samplers, using
+the `fast` command line tool (the same tool parser/run uses to build ast/)."""
+
+import os
+import sys
+import subprocess
+import tempfile
+
+sys.path.append(os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..', 'ast2vec', 'ast2vec'))
+import fast_pb2
+from fast_pickle_file_to_training_trees import _traverse_tree
+
+# source extensions understood by `fast`, mapped to the language names used
+# in input/language.name
+LANGUAGE_EXTENSIONS = {
+    '.cpp': 'cpp', '.cc': 'cpp', '.cxx': 'cpp', '.hpp': 'cpp', '.h': 'cpp',
+    '.java': 'java',
+}
+
+
+def language_of(path):
+    """Return the language of a source file, or None if `fast` can't parse it."""
+    return LANGUAGE_EXTENSIONS.get(os.path.splitext(path)[1].lower())
+
+
+def parse_file(path, fast_binary='fast'):
+    """Run `fast` on a source file and return (tree, num_nodes), where tree
+    is the nested {'node', 'children'} dict produced by
+    fast_pickle_file_to_training_trees. Returns None if the file can't be parsed."""
+
+    fd, pb_file = tempfile.mkstemp(suffix='.pb')
+    os.close(fd)
+    try:
+        with open(os.devnull, 'w') as devnull:
+            code = subprocess.call(
+                [fast_binary, '-S', path, pb_file], stdout=devnull, stderr=devnull
+            )
+        if code != 0 or os.path.getsize(pb_file) == 0:
+            return None
+        data = fast_pb2.Data()
+        with open(pb_file, 'rb') as fh:
+            data.ParseFromString(fh.read())
+    finally:
+        os.remove(pb_file)
+
+    if not data.HasField('element'):
+        return None
+    return _traverse_tree(data.element)
+
+
+
+def parse_source(source, extension, fast_binary='fast'):
+    """Same as parse_file, for source code held in memory (e.g. a git blob)."""
+    fd, src_file = tempfile.mkstemp(suffix=extension)
+    try:
+        with os.fdopen(fd, 'wb') as fh:
+            fh.write(source)
+        return parse_file(src_file, fast_binary)
+    finally:
+        os.remove(src_file)
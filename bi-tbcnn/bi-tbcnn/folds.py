@@ -0,0 +1,88 @@
+"""Deterministic, label-stratified k-fold splits of a trees pickle.
+
+The training and test trees of a pickle written by
+fast_pickle_file_to_training_trees.py are taken together as one corpus, in
+their order in the pickle. A manifest lists, for each of k folds, the
+indices of its trees in that corpus: the trees of every label are shuffled
+with a fixed seed and dealt round-robin to the folds, so every fold has
+about 1/k of the trees of each label and the same seed always gives the
+same folds. Fold i is the test set of run i, the other folds its training
+set; no tree is copied to make them."""
+
+import json
+from collections import defaultdict
+import numpy as np
+
+
+def add_arguments(parser):
+    """Add the cross-validation flags to a trainer's argument parser."""
+    group = parser.add_argument_group('cross-validation')
+    group.add_argument('--folds', default=None, metavar='MANIFEST',
+                       help='train and test on a fold of the folds manifest written by cross_validate.py')
+    group.add_argument('--fold', type=int, default=0, help='index of the test fold')
+    group.add_argument('--results', default=None, metavar='FILE',
+                       help='write the test accuracy and confusion matrix to FILE as JSON')
+
+
+def options(args):
+    """train_tbcnn.train_model keyword arguments from the flags of add_arguments."""
+    return {'manifest': args.folds, 'fold': args.fold, 'results': args.results}
+
+
+def make_folds(labels, k, seed=0):
+    """Split the indices of labels, the label of every tree of the corpus,
+    into k label-stratified folds."""
+    by_label = defaultdict(list)
+    for i, label in enumerate(labels):
+        by_label[label].append(i)
+    rng = np.random.RandomState(seed)
+    folds = [[] for _ in range(k)]
+    offset = 0
+    for label in sorted(by_label):
+        indices = by_label[label]
+        for j, position in enumerate(rng.permutation(len(indices))):
+            folds[(offset + j) % k].append(indices[position])
+        # start the next label where this one stopped, to balance the sizes
+        offset = (offset + len(indices)) % k
+    return [sorted(fold) for fold in folds]
+
+
+def corpus(trees, test_trees):
+    return list(trees) + list(test_trees)
+
+
+def save_manifest(path, infile, folds, seed):
+    with open(path, 'w') as fh:
+        json.dump({'trees': infile, 'seed': seed, 'folds': folds}, fh)
+
+
+def load_manifest(path):
+    with open(path) as fh:
+        return json.load(fh)
+
+
+def split(trees, test_trees, manifest, fold):
+    """The training and test trees of fold of the manifest file."""
+    folds = load_manifest(manifest)['folds']
+    if not 0 <= fold < len(folds):
+        raise ValueError('Fold %d of %d' % (fold, len(folds)))
+    all_trees = corpus(trees, test_trees)
+    if sum(len(f) for f in folds) != len(all_trees):
+        raise ValueError('%s was made for %d trees, the pickle has %d'
+                         % (manifest, sum(len(f) for f in folds), len(all_trees)))
+    train = [all_trees[i] for j, f in enumerate(folds) if j != fold for i in f]
+    return train, [all_trees[i] for i in folds[fold]]
+
+
+def write_results(path, labels, correct, predictions):
+    """Write the accuracy and confusion matrix (rows are the true labels) of
+    predictions, label indices like correct."""
+    confusion = np.zeros((len(labels), len(labels)), dtype=np.int64)
+    for c, p in zip(correct, predictions):
+        confusion[c, p] += 1
+    with open(path, 'w') as fh:
+        json.dump({
+            'labels': list(labels),
+            'accuracy': float(np.mean(np.equal(correct, predictions))) if len(correct) else 0.0,
+            'confusion': confusion.tolist(),
+        }, fh)
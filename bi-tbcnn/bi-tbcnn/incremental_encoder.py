@@ -0,0 +1,168 @@
+"""Re-encode edited files incrementally with a TBCNN classifier.
+
+The convolution output at a node only depends on the kind of the node and the
+kinds of its direct children, and the pooled vector of a tree is the max over
+its nodes, i.e. over the subtree maxima of the root's children and the root's
+own window. For every file the encoder keeps the conv output of each window
+(keyed by node kind and child kinds) and the max of each subtree (keyed by a
+hash of the subtree). After an edit:
+
+- subtrees whose hash is known reuse their stored max,
+- windows whose node and children are unchanged (e.g. the ancestors of an
+  edited function) reuse their stored conv output,
+- only the remaining windows go through the convolution, in one product.
+
+Usage as a script replays successive versions of a file, e.g. as saved by an
+editor, and reports how much work every version needed."""
+
+import time
+import pickle
+import hashlib
+import argparse
+import numpy as np
+import fast_parser
+import numpy_network as numpy_network
+from inference import load_labels
+
+
+class IncrementalEncoder(object):
+    """Holds the float TBCNN weights and the per-file activation state."""
+
+    def __init__(self, labels, embeddings, conv, hidden):
+        self.labels = list(labels)
+        self.embeddings = np.asarray(embeddings, dtype=np.float32)
+        self.weights, self.b_conv = numpy_network.conv_weights(conv)
+        self.hidden = hidden
+        # file key -> (subtree hash -> subtree max, window key -> conv output)
+        self.states = {}
+        self.windows_computed = 0
+        self.windows_reused = 0
+        self.subtrees_reused = 0
+
+    def _post_order(self, tree):
+        """Return the nodes of tree, children before parents."""
+        order = []
+        stack = [tree]
+        while stack:
+            node = stack.pop()
+            order.append(node)
+            stack.extend(node['children'])
+        order.reverse()
+        return order
+
+    def _window_inputs(self, window):
+        """Return the [x_t, x_r, x_l] row of a window, see
+        numpy_network.tree_windows."""
+        kinds = [int(kind) for kind in window]
+        features = self.embeddings[kinds]
+        n = len(kinds) - 1
+        x_r = np.zeros_like(features[0])
+        x_l = np.zeros_like(features[0])
+        for i, child in enumerate(features[1:]):
+            right = 0.5 if n == 1 else float(i) / (n - 1)
+            x_r += right * child
+            x_l += (1.0 - right) * child
+        return np.concatenate([features[0], x_r, x_l])
+
+    def encode(self, key, tree):
+        """Encode the current version of the file identified by key, and
+        return its pooled vector and class probabilities."""
+        old_subtrees, old_windows = self.states.get(key, ({}, {}))
+        subtrees, windows = {}, {}
+
+        # subtree hashes and windows of every node, bottom-up
+        order = self._post_order(tree)
+        hashes, node_windows = {}, {}
+        missing = []
+        for node in order:
+            window = (str(node['node']),) + tuple(str(child['node']) for child in node['children'])
+            digest = hashlib.sha1(window[0].encode('ascii'))
+            for child in node['children']:
+                digest.update(hashes[id(child)])
+            hashes[id(node)] = digest.digest()
+            node_windows[id(node)] = window
+            if window in windows:
+                continue
+            if window in old_windows:
+                windows[window] = old_windows[window]
+                self.windows_reused += 1
+            else:
+                windows[window] = None
+                missing.append(window)
+
+        if missing:
+            x = np.stack([self._window_inputs(window) for window in missing])
+            for window, out in zip(missing, np.tanh(x.dot(self.weights) + self.b_conv)):
+                windows[window] = out
+            self.windows_computed += len(missing)
+
+        for node in order:
+            h = hashes[id(node)]
+            if h in subtrees:
+                continue
+            if h in old_subtrees:
+                subtrees[h] = old_subtrees[h]
+                self.subtrees_reused += 1
+                continue
+            pooled = windows[node_windows[id(node)]]
+            for child in node['children']:
+                pooled = np.maximum(pooled, subtrees[hashes[id(child)]])
+            subtrees[h] = pooled
+        self.states[key] = (subtrees, windows)
+
+        pooled = subtrees[hashes[id(tree)]]
+        out = pooled[None, :]
+        for w, b in self.hidden:
+            out = numpy_network.lrelu(out.dot(w) + b)
+        return pooled, numpy_network.softmax(out)[0]
+
+    def forget(self, key):
+        """Drop the state of a closed or deleted file."""
+        self.states.pop(key, None)
+
+
+def replay(logdir, embedfile, files, infile=None, statefile=None):
+    """Encode successive versions of one file and report the work done."""
+    with open(embedfile, 'rb') as fh:
+        embeddings, _ = pickle.load(fh)
+    conv, hidden = numpy_network.load_checkpoint_weights(logdir)
+    encoder = IncrementalEncoder(load_labels(logdir, infile), embeddings, conv, hidden)
+    if statefile is not None:
+        try:
+            with open(statefile, 'rb') as fh:
+                encoder.states = pickle.load(fh)
+        except IOError:
+            pass
+
+    for path in files:
+        result = fast_parser.parse_file(path)
+        if result is None:
+            print(path + ': parse failed')
+            continue
+        tree, num_nodes = result
+        computed, reused = encoder.windows_computed, encoder.subtrees_reused
+        start = time.time()
+        _, probs = encoder.encode('file', tree)
+        print('%s: %s (%.4f), %d nodes, %d windows computed, %d subtrees reused, %.2f ms' % (
+            path, encoder.labels[int(np.argmax(probs))], np.max(probs), num_nodes,
+            encoder.windows_computed - computed, encoder.subtrees_reused - reused,
+            1000 * (time.time() - start)))
+
+    if statefile is not None:
+        with open(statefile, 'wb') as fh:
+            pickle.dump(encoder.states, fh, pickle.HIGHEST_PROTOCOL)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('logdir', help='directory holding the train_tbcnn.py checkpoints')
+    parser.add_argument('embeddings')
+    parser.add_argument('files', nargs='+', help='successive versions of one source file')
+    parser.add_argument('--trees', default=None, help='training trees pickle, to read the labels of older models')
+    parser.add_argument('--state', default=None, help='keep the activation state in this file between runs')
+    args = parser.parse_args()
+
+    replay(args.logdir, args.embeddings, args.files, args.trees, args.state)
+
+if __name__ == "__main__":
+    main()
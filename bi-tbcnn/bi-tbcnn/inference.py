@@ -0,0 +1,252 @@
+"""Load the models trained by train_tbcnn.py and train_bitbcnn.py and run
+batched inference on unlabelled trees."""
+
+import os
+import pickle
+import hashlib
+import tensorflow as tf
+import numpy as np
+import network as network
+import sampling as sampling
+
+LABELS_FILE = 'labels.pkl'
+STUDENT_FILE = 'student.pkl'
+LANGUAGES_FILE = 'languages.pkl'
+
+
+def save_labels(logdir, labels):
+    """Store the label order used for training next to the checkpoints, so
+    that the inference path can map the output units back to names."""
+    if not os.path.isdir(logdir):
+        os.makedirs(logdir)
+    with open(os.path.join(logdir, LABELS_FILE), 'wb') as fh:
+        pickle.dump(list(labels), fh)
+
+
+def read_label_file(path):
+    """The labels listed in a vocabulary file, one per line like
+    algorithms.txt; blank lines and lines starting with # are skipped."""
+    labels = []
+    with open(path) as fh:
+        for line in fh:
+            label = line.strip()
+            if label and not label.startswith('#') and label not in labels:
+                labels.append(label)
+    return labels
+
+
+def load_labels(logdir, infile=None):
+    """Load the training label order from the logdir, or from the training
+    trees pickle for models trained before labels were stored."""
+    path = os.path.join(logdir, LABELS_FILE)
+    if os.path.isfile(path):
+        with open(path, 'rb') as fh:
+            return pickle.load(fh)
+    if infile is None:
+        raise ValueError('No %s in %s, pass the training trees pickle' % (LABELS_FILE, logdir))
+    with open(infile, 'rb') as fh:
+        _, _, labels = pickle.load(fh)
+    return labels
+
+
+def save_student(logdir, conv_size, embeddings, max_depth):
+    """Store how a student distilled by distill_tbcnn.py differs from the
+    TBCNN: its number of convolution outputs, its own (smaller) embedding of
+    the node kinds and the depth its trees are cut at (or None)."""
+    with open(os.path.join(logdir, STUDENT_FILE), 'wb') as fh:
+        pickle.dump({'conv_size': conv_size, 'embeddings': embeddings, 'max_depth': max_depth}, fh)
+
+
+def load_student(logdir):
+    """The student settings of logdir, or None for a TBCNN of train_tbcnn.py."""
+    path = os.path.join(logdir, STUDENT_FILE)
+    if not os.path.isfile(path):
+        return None
+    with open(path, 'rb') as fh:
+        return pickle.load(fh)
+
+
+def save_languages(logdir, languages):
+    """Store the languages of a model of train_multilang.py, in the order of
+    their adapters, with their embeddings files and the sizes of the model."""
+    with open(os.path.join(logdir, LANGUAGES_FILE), 'wb') as fh:
+        pickle.dump(languages, fh)
+
+
+def load_languages(logdir):
+    with open(os.path.join(logdir, LANGUAGES_FILE), 'rb') as fh:
+        return pickle.load(fh)
+
+
+def pad_embeddings(embeddings, feature_size):
+    """The embeddings with zero features appended up to feature_size."""
+    embeddings = np.asarray(embeddings, dtype=np.float32)
+    return np.pad(embeddings, [(0, 0), (0, feature_size - embeddings.shape[1])], 'constant')
+
+
+def restore(sess, logdir):
+    """Restore the latest checkpoint of logdir into the graph of sess."""
+    saver = tf.train.Saver()
+    ckpt = tf.train.get_checkpoint_state(logdir)
+    if ckpt and ckpt.model_checkpoint_path:
+        saver.restore(sess, ckpt.model_checkpoint_path)
+    else:
+        raise IOError('Checkpoint not found in ' + logdir)
+
+
+def encode_batches(sess, fetches, nodes_node, children_node, trees, embeddings, batch_size, feed_dict=None):
+    """Run fetches over trees in padded batches, concatenating every fetch
+    along the batch axis. feed_dict holds the other inputs of every batch."""
+    results = [[] for _ in fetches]
+    for nodes, children, counts in sampling.batch_unlabelled_samples(
+        sampling.gen_unlabelled_samples(trees, embeddings), batch_size
+    ):
+        feed = dict(feed_dict or {})
+        feed.update({
+            nodes_node: nodes,
+            children_node: children,
+            network.node_counts(nodes_node): counts,
+        })
+        values = sess.run(fetches, feed_dict=feed)
+        for result, value in zip(results, values):
+            result.append(value)
+    return [np.concatenate(result, axis=0) if result else np.zeros((0, 0)) for result in results]
+
+
+class TreeClassifier(object):
+    """A restored TBCNN classifier living in its own graph and session. A
+    student of distill_tbcnn.py brings its own embeddings, embedfile is
+    ignored for it."""
+
+    def __init__(self, logdir, embedfile, labels, config=None):
+        student = load_student(logdir)
+        if student is not None:
+            self.embeddings = student['embeddings']
+            conv_size, self.max_depth = student['conv_size'], student['max_depth']
+        else:
+            with open(embedfile, 'rb') as fh:
+                self.embeddings, _ = pickle.load(fh)
+            conv_size, self.max_depth = 100, None
+        self.labels = list(labels)
+        num_feats = len(self.embeddings[0])
+
+        self.graph = tf.Graph()
+        with self.graph.as_default():
+            self.nodes_node, self.children_node, self.pooling_node, hidden_node = \
+                network.init_net_with_pooling(num_feats, len(self.labels), conv_size)
+            self.out_node = network.out_layer(hidden_node)
+
+            self.sess = tf.Session(config=config)
+            restore(self.sess, logdir)
+
+    def predict(self, trees, batch_size):
+        """Return a (len(trees) x num_labels) array of class probabilities."""
+        return self.encode(trees, batch_size)[1]
+
+    def encode(self, trees, batch_size):
+        """Return the pooled tree vectors and the class probabilities of trees."""
+        if not trees:
+            return np.zeros((0, 0)), np.zeros((0, len(self.labels)))
+        if self.max_depth is not None:
+            trees = [sampling.cap_depth(tree, self.max_depth) for tree in trees]
+        return encode_batches(self.sess, [self.pooling_node, self.out_node],
+                              self.nodes_node, self.children_node,
+                              trees, self.embeddings, batch_size)
+
+    def digest(self):
+        """Identifies the weights, embeddings, labels and depth cap of the
+        model, see tree_cache.CachedClassifier."""
+        digest = hashlib.sha1()
+        with self.graph.as_default():
+            variables = tf.global_variables()
+        for value in self.sess.run(variables):
+            digest.update(np.ascontiguousarray(value).tobytes())
+        digest.update(np.ascontiguousarray(self.embeddings, dtype=np.float32).tobytes())
+        digest.update(repr((self.labels, self.max_depth)).encode('utf-8'))
+        return digest.hexdigest()
+
+    def close(self):
+        self.sess.close()
+
+
+class BiTreeEncoder(object):
+    """A restored Bi-TBCNN trained by train_bitbcnn.py. The left tower encodes
+    trees of the left language (cpp) and the right tower those of the right
+    language (java). The towers are trained separately and only meet in the
+    hidden layers, so a vector of one tower compares with vectors of the
+    same tower only; see MultiLanguageEncoder for one space of languages."""
+
+    def __init__(self, logdir, left_embedfile, right_embedfile, config=None):
+        with open(left_embedfile, 'rb') as fh:
+            self.left_embeddings, _ = pickle.load(fh)
+        with open(right_embedfile, 'rb') as fh:
+            self.right_embeddings, _ = pickle.load(fh)
+        num_feats = len(self.left_embeddings[0])
+
+        self.graph = tf.Graph()
+        with self.graph.as_default():
+            (self.left_nodes_node, self.left_children_node, self.left_pooling_node,
+             self.right_nodes_node, self.right_children_node, self.right_pooling_node,
+             hidden_node) = network.init_net_bitbcnn(num_feats, 2)
+            self.out_node = network.out_layer(hidden_node)
+
+            self.sess = tf.Session(config=config)
+            restore(self.sess, logdir)
+
+    def encode(self, trees, side, batch_size):
+        """Return the pooled vectors of trees encoded by the 'left' or 'right' tower."""
+        if side == 'left':
+            return encode_batches(self.sess, [self.left_pooling_node],
+                                  self.left_nodes_node, self.left_children_node,
+                                  trees, self.left_embeddings, batch_size)[0]
+        return encode_batches(self.sess, [self.right_pooling_node],
+                              self.right_nodes_node, self.right_children_node,
+                              trees, self.right_embeddings, batch_size)[0]
+
+    def similarity(self, left_vectors, right_vectors):
+        """Return the probability that each pair of pooled left and right
+        vectors is the same algorithm. The pooled tensors are fed directly,
+        so only the hidden layers run."""
+        return self.sess.run(self.out_node, feed_dict={
+            self.left_pooling_node: left_vectors,
+            self.right_pooling_node: right_vectors,
+        })[:, 1]
+
+    def close(self):
+        self.sess.close()
+
+
+class MultiLanguageEncoder(object):
+    """A restored model of train_multilang.py, encoding the trees of any of
+    its languages into one space of unit vectors. Every tree is encoded
+    once, whatever the number of languages it is compared with."""
+
+    def __init__(self, logdir, config=None):
+        self.languages = load_languages(logdir)
+        self.embeddings = {}
+        for language in self.languages['languages']:
+            with open(language['embeddings'], 'rb') as fh:
+                embeddings, _ = pickle.load(fh)
+            self.embeddings[language['name']] = pad_embeddings(embeddings, self.languages['feature_size'])
+        self.ids = {language['name']: i for i, language in enumerate(self.languages['languages'])}
+
+        self.graph = tf.Graph()
+        with self.graph.as_default():
+            (self.nodes_node, self.children_node, self.language_node, self.vectors_node), _ = \
+                network.init_net_multilang(self.languages['feature_size'], len(self.ids),
+                                           self.languages['adapter_size'])
+            self.sess = tf.Session(config=config)
+            restore(self.sess, logdir)
+
+    def encode(self, trees, language, batch_size):
+        """Return the unit vectors of trees of language."""
+        return encode_batches(self.sess, [self.vectors_node], self.nodes_node, self.children_node,
+                              trees, self.embeddings[language], batch_size,
+                              {self.language_node: self.ids[language]})[0]
+
+    def similarity(self, vectors, other_vectors):
+        """The cosine similarity of every vector with every other vector."""
+        return np.dot(vectors, np.transpose(other_vectors))
+
+    def close(self):
+        self.sess.close()
@@ -0,0 +1,163 @@
+"""Throughput and resource metrics of a training job.
+
+Every step is recorded with the number of samples (trees or pairs) and AST
+nodes it trained on and how long it took. Every few seconds the steps of the
+interval are summarized into one record:
+
+- samples and nodes per second,
+- the 50th, 90th and 99th percentiles of the step latency,
+- the resident memory of the process and its CPU utilisation, in cores.
+
+Records are appended as JSON lines to a file and written as TensorBoard
+scalars under metrics/. The rates are those of one worker; with
+data-parallel training the job trains `workers` times as fast."""
+
+import os
+import json
+import time
+import logging
+import numpy as np
+import tensorflow as tf
+
+
+def add_arguments(parser):
+    """Add the metrics and logging flags to a trainer's argument parser."""
+    group = parser.add_argument_group('metrics')
+    group.add_argument('--metrics', default=None, metavar='FILE',
+                       help='append throughput and resource metrics to FILE as JSON lines')
+    group.add_argument('--metrics-secs', type=float, default=30,
+                       help='summarize the metrics every this many seconds')
+    group.add_argument('--eval-every', type=int, default=0, metavar='EPOCHS',
+                       help='measure the test accuracy every this many epochs, to report the '
+                            'training time needed to reach the final accuracy')
+    group.add_argument('--log-level', default='info', choices=['debug', 'info'],
+                       help='debug also prints the labels and outputs of every batch')
+
+
+def configure_logging(args):
+    logging.basicConfig(format='%(message)s',
+                        level=logging.DEBUG if args.log_level == 'debug' else logging.INFO)
+
+
+def options(args):
+    """MetricsLogger keyword arguments from the flags of add_arguments."""
+    return {'outfile': args.metrics, 'every_secs': args.metrics_secs}
+
+
+def rss_bytes():
+    """Resident memory of this process, or its peak where /proc is missing."""
+    try:
+        with open('/proc/self/statm') as fh:
+            return int(fh.read().split()[1]) * os.sysconf('SC_PAGE_SIZE')
+    except (IOError, OSError):
+        import resource
+        return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss * 1024
+
+
+def cpu_seconds():
+    times = os.times()
+    return times[0] + times[1]
+
+
+class MetricsLogger(object):
+    """Summarizes the steps recorded with step() every every_secs seconds.
+    unit names the samples, e.g. 'trees' or 'pairs'. With no outfile and no
+    writer nothing is collected."""
+
+    def __init__(self, outfile=None, every_secs=30, unit='trees', writer=None, workers=1):
+        self.outfile = outfile
+        self.every_secs = every_secs
+        self.unit = unit
+        self.writer = writer
+        self.workers = workers
+        self.enabled = outfile is not None or writer is not None
+        self._reset()
+
+    def _reset(self):
+        self.start = time.time()
+        self.start_cpu = cpu_seconds()
+        self.samples = 0
+        self.nodes = 0
+        self.latencies = []
+
+    def step(self, step, samples, nodes, seconds):
+        """Record a step of samples with nodes AST nodes in total, and write
+        a record if the interval is over."""
+        if not self.enabled:
+            return
+        self.samples += samples
+        self.nodes += nodes
+        self.latencies.append(seconds)
+        if time.time() - self.start >= self.every_secs:
+            self.emit(step)
+
+    def emit(self, step):
+        """Write the record of the steps since the last one."""
+        if not self.enabled or not self.latencies:
+            return
+        elapsed = time.time() - self.start
+        p50, p90, p99 = np.percentile(self.latencies, [50, 90, 99])
+        record = {
+            'step': step,
+            'time': time.time(),
+            'workers': self.workers,
+            self.unit + '_per_sec': self.samples / elapsed,
+            'nodes_per_sec': self.nodes / elapsed,
+            'step_ms_p50': p50 * 1000,
+            'step_ms_p90': p90 * 1000,
+            'step_ms_p99': p99 * 1000,
+            'rss_mb': rss_bytes() / 2.0 ** 20,
+            'cpu_cores': (cpu_seconds() - self.start_cpu) / elapsed,
+        }
+        if self.outfile is not None:
+            with open(self.outfile, 'a') as fh:
+                fh.write(json.dumps(record, sort_keys=True) + '\n')
+        if self.writer is not None:
+            summary = tf.Summary(value=[
+                tf.Summary.Value(tag='metrics/' + key, simple_value=value)
+                for key, value in sorted(record.items()) if key not in ('step', 'time', 'workers')
+            ])
+            self.writer.add_summary(summary, step)
+        self._reset()
+
+    def close(self, step):
+        self.emit(step)
+        if self.writer is not None:
+            self.writer.flush()
+
+
+class AccuracyTimeline(object):
+    """The accuracy of periodic evaluations against the training time,
+    which excludes the time spent evaluating. Every evaluation is appended
+    to outfile as a JSON line if given."""
+
+    def __init__(self, outfile=None):
+        self.outfile = outfile
+        self.start = time.time()
+        self.eval_seconds = 0.0
+        self.points = []
+
+    def add(self, epoch, accuracy, eval_seconds=0.0):
+        """Record the accuracy after epoch, measured in eval_seconds."""
+        self.eval_seconds += eval_seconds
+        seconds = time.time() - self.start - self.eval_seconds
+        self.points.append((seconds, epoch, accuracy))
+        if self.outfile is not None:
+            with open(self.outfile, 'a') as fh:
+                fh.write(json.dumps({'epoch': epoch, 'train_secs': seconds, 'accuracy': accuracy},
+                                    sort_keys=True) + '\n')
+
+    def time_to(self, accuracy):
+        """First (training seconds, epoch) at which accuracy was reached, or None."""
+        for seconds, epoch, reached in self.points:
+            if reached >= accuracy:
+                return seconds, epoch
+        return None
+
+    def report(self):
+        if not self.points:
+            return
+        final_seconds, final_epoch, final = self.points[-1]
+        seconds, epoch = self.time_to(final)
+        print('Reached the final accuracy %.4f after %.0f of %.0f training seconds (epoch %d of %d)'
+              % (final, seconds, final_seconds, epoch, final_epoch))
@@ -8,17 +8,37 @@ import tensorflow as tf
 def init_net(feature_size, label_size):
     """Initialize an empty network."""
 
+    nodes, children, _, hidden = init_net_with_pooling(feature_size, label_size)
+    return nodes, children, hidden
+
+
+def init_net_with_pooling(feature_size, label_size, conv_size=100):
+    """Same as init_net, also returning the pooled tree vectors. conv_size is
+    the number of convolution outputs, smaller for distilled students."""
+
+    nodes, children, pooling, hidden, _ = init_net_with_head(feature_size, label_size, conv_size)
+    return nodes, children, pooling, hidden
+
+
+def init_net_with_head(feature_size, label_size, conv_size=100):
+    """Same as init_net_with_pooling, also returning the weights and biases
+    of the output layer, for sampled_loss_layer."""
+
     with tf.name_scope('inputs'):
         nodes = tf.placeholder(tf.float32, shape=(None, None, feature_size), name='tree')
         children = tf.placeholder(tf.int32, shape=(None, None, None), name='children')
+        counts = tf.placeholder(tf.int32, shape=(None,), name='node_counts')
 
     with tf.name_scope('network'):
-        conv1 = conv_layer(1, 100, nodes, children, feature_size)
+        conv1 = conv_layer(1, conv_size, nodes, children, feature_size)
         #conv2 = conv_layer(1, 10, conv1, children, 100)
-        pooling = pooling_layer(conv1)
-        hidden = hidden_layer(pooling, 100, label_size)
+        pooling = pooling_layer(conv1, counts)
+        # hidden_layer, keeping its variables
+        with tf.name_scope("hidden"):
+            weights, biases = hidden_variables(conv_size, label_size)
+            hidden = lrelu(tf.matmul(pooling, weights) + biases, 0.01)
 
-    return nodes, children, hidden
+    return nodes, children, pooling, hidden, (weights, biases)
 
 
 def init_net_for_siamese(feature_size):
@@ -27,16 +47,37 @@ def init_net_for_siamese(feature_size):
     with tf.name_scope("inputs"):
         nodes = tf.placeholder(tf.float32, shape=(None, None, feature_size), name='tree')
         children = tf.placeholder(tf.int32, shape=(None, None, None), name='children')
+        counts = tf.placeholder(tf.int32, shape=(None,), name='node_counts')
 
     with tf.name_scope("network"):
         conv1 = conv_layer(1, 100, nodes, children, feature_size)
         #conv2 = conv_layer(1, 10, conv1, children, 100)
-        pooling = pooling_layer(conv1)
+        pooling = pooling_layer(conv1, counts)
      
 
     return nodes, children, pooling
 
 
+def init_net_bitbcnn(feature_size, label_size, drop_out=None):
+    """Initialize an empty Bi-TBCNN: one TBCNN tower per language, whose pooled
+    tree vectors are concatenated and classified by a stack of hidden layers.
+    With drop_out set, dropout is applied after every hidden layer as in
+    train_bitbcnn.py."""
+
+    left_nodes, left_children, left_pooling = init_net_for_siamese(feature_size)
+    right_nodes, right_children, right_pooling = init_net_for_siamese(feature_size)
+
+    merge = tf.concat([left_pooling, right_pooling], -1)
+    hidden = merge
+    for input_size, output_size in [(200, 200), (200, 200), (200, label_size)]:
+        hidden = hidden_layer(hidden, input_size, output_size)
+        if drop_out is not None:
+            hidden = tf.layers.dropout(hidden, rate=drop_out, training=True)
+
+    return (left_nodes, left_children, left_pooling,
+            right_nodes, right_children, right_pooling, hidden)
+
+
 def conv_layer(num_conv, output_size, nodes, children, feature_size):
     """Creates a convolution layer with num_conv convolutions merged together at
     the output. Final output will be a tensor with shape
@@ -49,18 +90,23 @@ def conv_layer(num_conv, output_size, nodes, children, feature_size):
         ]
         return tf.concat(nodes, axis=2)
 
+def conv_variables(feature_size, output_size):
+    """The weights and bias of a tree convolution."""
+    std = 1.0 / math.sqrt(feature_size)
+    w_t, w_l, w_r = (
+        tf.Variable(tf.truncated_normal([feature_size, output_size], stddev=std), name='Wt'),
+        tf.Variable(tf.truncated_normal([feature_size, output_size], stddev=std), name='Wl'),
+        tf.Variable(tf.truncated_normal([feature_size, output_size], stddev=std), name='Wr'),
+    )
+    init = tf.truncated_normal([output_size,], stddev=math.sqrt(2.0/feature_size))
+    #init = tf.zeros([output_size,])
+    b_conv = tf.Variable(init, name='b_conv')
+    return w_t, w_l, w_r, b_conv
+
 def conv_node(nodes, children, feature_size, output_size):
     """Perform convolutions over every batch sample."""
     with tf.name_scope('conv_node'):
-        std = 1.0 / math.sqrt(feature_size)
-        w_t, w_l, w_r = (
-            tf.Variable(tf.truncated_normal([feature_size, output_size], stddev=std), name='Wt'),
-            tf.Variable(tf.truncated_normal([feature_size, output_size], stddev=std), name='Wl'),
-            tf.Variable(tf.truncated_normal([feature_size, output_size], stddev=std), name='Wr'),
-        )
-        init = tf.truncated_normal([output_size,], stddev=math.sqrt(2.0/feature_size))
-        #init = tf.zeros([output_size,])
-        b_conv = tf.Variable(init, name='b_conv')
+        w_t, w_l, w_r, b_conv = conv_variables(feature_size, output_size)
 
         with tf.name_scope('summaries'):
             tf.summary.histogram('w_t', [w_t])
@@ -244,9 +290,23 @@ def eta_l(children, coef_t, coef_r):
         )
 
 
-def pooling_layer(nodes):
-    """Creates a max dynamic pooling layer from the nodes."""
+def node_counts(nodes):
+    """The node_counts input of the network of the nodes input: the number of
+    real nodes of each tree of a batch, which sampling pads to the largest
+    tree of the batch. It must be fed along with the nodes."""
+    scope = nodes.op.name.rsplit('/', 1)[0]
+    return nodes.graph.get_tensor_by_name(scope + '/node_counts:0')
+
+
+def pooling_layer(nodes, counts=None):
+    """Creates a max dynamic pooling layer from the nodes. Given the number
+    of real nodes of each tree, the padding is left out of the max, so a
+    tree pools to the same vector whatever trees it is batched with."""
     with tf.name_scope("pooling"):
+        if counts is not None:
+            mask = tf.sequence_mask(counts, tf.shape(nodes)[1])
+            mask = tf.tile(tf.expand_dims(mask, 2), [1, 1, tf.shape(nodes)[2]])
+            nodes = tf.where(mask, nodes, tf.fill(tf.shape(nodes), nodes.dtype.min))
         pooled = tf.reduce_max(nodes, axis=1)
         return pooled
 
@@ -254,23 +314,41 @@ def pooling_layer(nodes):
 def lrelu(x, alpha):
     return tf.nn.relu(x) - alpha * tf.nn.relu(-x)
 
+def hidden_variables(input_size, output_size):
+    """The weights and biases of a hidden layer."""
+    weights = tf.Variable(
+        tf.truncated_normal(
+            [input_size, output_size], stddev=1.0 / math.sqrt(input_size)
+        ),
+        name='weights'
+    )
+
+    init = tf.truncated_normal([output_size,], stddev=math.sqrt(2.0/input_size))
+    #init = tf.zeros([output_size,])
+    biases = tf.Variable(init, name='biases')
+    return weights, biases
+
 def hidden_layer(pooled, input_size, output_size):
     """Create a hidden feedforward layer."""
     with tf.name_scope("hidden"):
-        weights = tf.Variable(
-            tf.truncated_normal(
-                [input_size, output_size], stddev=1.0 / math.sqrt(input_size)
-            ),
-            name='weights'
-        )
-
-        init = tf.truncated_normal([output_size,], stddev=math.sqrt(2.0/input_size))
-        #init = tf.zeros([output_size,])
-        biases = tf.Variable(init, name='biases')
+        weights, biases = hidden_variables(input_size, output_size)
 
         # return tf.nn.lrelu(tf.matmul(pooled, weights) + biases)
         return lrelu(tf.matmul(pooled, weights) + biases, 0.01)
 
+def pairwise_hidden_layer(left, right, input_size, output_size):
+    """Same as hidden_layer over the concatenation of every left vector with
+    every right vector, with the same variables. The product with each half
+    of the weights is computed once per vector and summed for every pair.
+    Returns [left_size * right_size, output_size], ordered by left first."""
+    with tf.name_scope("hidden"):
+        weights, biases = hidden_variables(input_size, output_size)
+        split = int(left.get_shape()[-1])
+        left_part = tf.matmul(left, weights[:split])
+        right_part = tf.matmul(right, weights[split:])
+        pairs = tf.expand_dims(left_part, 1) + tf.expand_dims(right_part, 0) + biases
+        return lrelu(tf.reshape(pairs, [-1, output_size]), 0.01)
+
 
 def loss_layer(logits_node, label_size):
     """Create a loss layer for training."""
@@ -286,6 +364,138 @@ def loss_layer(logits_node, label_size):
 
         return labels, loss
 
+def sampled_loss_layer(pooling_node, head, label_size, num_sampled):
+    """Create a loss for many labels: the cross entropy of the true label
+    against num_sampled other labels drawn uniformly at every step, instead
+    of against all label_size of them. head holds the weights and biases of
+    the output layer (see init_net_with_head), whose logits are taken before
+    its lrelu; that is monotonic, so out_layer predicts the same label.
+    Takes the label ids instead of one-hot labels."""
+
+    weights, biases = head
+    labels = tf.placeholder(tf.int64, (None,))
+
+    with tf.name_scope('sampled_loss_layer'):
+        true_classes = tf.expand_dims(labels, 1)
+        sampled = tf.nn.uniform_candidate_sampler(
+            true_classes=true_classes, num_true=1, num_sampled=num_sampled, unique=True, range_max=label_size
+        )
+        cross_entropy = tf.nn.sampled_softmax_loss(
+            weights=tf.transpose(weights), biases=biases, labels=true_classes, inputs=pooling_node,
+            num_sampled=num_sampled, num_classes=label_size, sampled_values=sampled,
+            remove_accidental_hits=True, name='sampled_cross_entropy'
+        )
+        loss = tf.reduce_mean(cross_entropy, name='cross_entropy_mean')
+
+        return labels, loss
+
+def distillation_loss_layer(logits_node, label_size, temperature, alpha):
+    """Create the loss of a student trained on the true labels and on the
+    soft labels of a teacher, its output distribution at temperature. The
+    soft term is scaled by temperature ** 2 to keep its gradients in the
+    scale of the hard term, and weighted by 1 - alpha."""
+
+    labels = tf.placeholder(tf.float32, (None, label_size,))
+    soft_labels = tf.placeholder(tf.float32, (None, label_size,))
+
+    with tf.name_scope('distillation_loss_layer'):
+        hard = tf.reduce_mean(tf.nn.softmax_cross_entropy_with_logits(
+            labels=labels, logits=logits_node, name='hard_cross_entropy'
+        ))
+        soft = tf.reduce_mean(tf.nn.softmax_cross_entropy_with_logits(
+            labels=soft_labels, logits=logits_node / temperature, name='soft_cross_entropy'
+        ))
+        loss = tf.add(alpha * hard, (1.0 - alpha) * temperature ** 2 * soft, name='distillation_loss')
+
+        return labels, soft_labels, loss
+
+def pairwise_loss_layer(logits_node, objective):
+    """Create the loss of the [left_size * right_size, 2] logits of
+    pairwise_hidden_layer, given the label ids of the left and right trees.
+    Pairs of the same label are the positives.
+
+    'all-pairs' is the cross entropy of every pair, the positives and the
+    negatives weighted equally; 'infonce' scores every pair by its logit
+    difference and is the cross entropy of picking a positive among each
+    row, and each column, of the scores."""
+
+    left_labels = tf.placeholder(tf.int32, (None,))
+    right_labels = tf.placeholder(tf.int32, (None,))
+
+    with tf.name_scope('pairwise_loss_layer'):
+        same = tf.cast(tf.equal(tf.expand_dims(left_labels, 1), tf.expand_dims(right_labels, 0)), tf.float32)
+        shape = tf.shape(same)
+        if objective == 'all-pairs':
+            cross_entropy = tf.reshape(tf.nn.softmax_cross_entropy_with_logits(
+                labels=tf.stack([1.0 - tf.reshape(same, [-1]), tf.reshape(same, [-1])], axis=1),
+                logits=logits_node, name='cross_entropy'
+            ), shape)
+            positives = tf.reduce_sum(cross_entropy * same) / tf.maximum(tf.reduce_sum(same), 1.0)
+            negatives = tf.reduce_sum(cross_entropy * (1.0 - same)) / tf.maximum(tf.reduce_sum(1.0 - same), 1.0)
+            loss = tf.multiply(0.5, positives + negatives, name='cross_entropy_mean')
+        else:
+            loss = info_nce(tf.reshape(logits_node[:, 1] - logits_node[:, 0], shape), same)
+
+        return left_labels, right_labels, loss
+
+def info_nce(scores, same):
+    """The cross entropy of picking a positive (same is 1) among each row,
+    and each column, of the [left_size, right_size] scores, rows and columns
+    without a positive left out."""
+    # log(0) for the negatives, without the infinities
+    positive_scores = scores + (same - 1.0) * 1e9
+    losses = []
+    for axis in [1, 0]:
+        has_positive = tf.cast(tf.reduce_max(same, axis=axis) > 0, tf.float32)
+        nce = tf.reduce_logsumexp(scores, axis=axis) - tf.reduce_logsumexp(positive_scores, axis=axis)
+        losses.append(tf.reduce_sum(nce * has_positive) / tf.maximum(tf.reduce_sum(has_positive), 1.0))
+    return tf.multiply(0.5, losses[0] + losses[1], name='info_nce')
+
+def init_net_multilang(feature_size, num_languages, adapter_size=30, conv_size=100, vector_size=100):
+    """Initialize a TBCNN encoding the trees of num_languages languages into
+    one space. The node vectors of every language, padded to feature_size,
+    go through an adapter of that language into adapter_size features; the
+    convolution, pooling and projection to unit vectors of vector_size are
+    shared by all languages, so only the adapters grow with the number of
+    languages. Returns the nodes, children and language id inputs and the
+    vectors of a 'left' and a 'right' batch, encoded by the same network."""
+
+    with tf.name_scope('multilang'):
+        adapters = tf.Variable(tf.truncated_normal(
+            [num_languages, feature_size, adapter_size], stddev=1.0 / math.sqrt(feature_size)
+        ), name='adapters')
+        w_t, w_l, w_r, b_conv = conv_variables(adapter_size, conv_size)
+        with tf.name_scope('projection'):
+            weights, biases = hidden_variables(conv_size, vector_size)
+
+    sides = []
+    for side in ['left', 'right']:
+        with tf.name_scope(side + '_inputs'):
+            nodes = tf.placeholder(tf.float32, shape=(None, None, feature_size), name='tree')
+            children = tf.placeholder(tf.int32, shape=(None, None, None), name='children')
+            counts = tf.placeholder(tf.int32, shape=(None,), name='node_counts')
+            language = tf.placeholder(tf.int32, shape=(), name='language')
+        with tf.name_scope(side + '_network'):
+            adapted = tf.tensordot(nodes, tf.gather(adapters, language), axes=1)
+            pooling = pooling_layer(conv_step(adapted, children, adapter_size, w_t, w_r, w_l, b_conv),
+                                    counts)
+            vectors = tf.nn.l2_normalize(tf.matmul(pooling, weights) + biases, 1)
+        sides.append((nodes, children, language, vectors))
+    return sides
+
+def similarity_loss_layer(left_vectors, right_vectors, temperature):
+    """Create the InfoNCE loss of the cosine similarities of every left and
+    right unit vector at temperature, given their label ids. Pairs of the
+    same label are the positives."""
+
+    left_labels = tf.placeholder(tf.int32, (None,))
+    right_labels = tf.placeholder(tf.int32, (None,))
+
+    with tf.name_scope('similarity_loss_layer'):
+        same = tf.cast(tf.equal(tf.expand_dims(left_labels, 1), tf.expand_dims(right_labels, 0)), tf.float32)
+        scores = tf.matmul(left_vectors, right_vectors, transpose_b=True) / temperature
+        return left_labels, right_labels, info_nce(scores, same)
+
 def out_layer(logits_node):
     """Apply softmax to the output layer."""
     with tf.name_scope('output'):
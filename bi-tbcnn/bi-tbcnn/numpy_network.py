@@ -0,0 +1,93 @@
+"""A numpy implementation of the forward pass of network.py, for inference
+paths that don't go through a tensorflow session.
+
+Instead of padding a batch of trees to the same size, the nodes of all trees
+are stacked into one matrix, so a batch costs one matrix product per layer
+whatever the spread of tree sizes."""
+
+from collections import deque
+import numpy as np
+
+
+def load_checkpoint_weights(logdir, prefix='network'):
+    """Read the TBCNN variables under prefix from the latest checkpoint of
+    logdir. Returns (conv, hidden) where conv is (w_t, w_r, w_l, b_conv) and
+    hidden is a list of (weights, biases) in the order they are applied."""
+    import tensorflow as tf
+    reader = tf.train.NewCheckpointReader(tf.train.latest_checkpoint(logdir))
+    conv_scope = prefix + '/conv_layer/conv_node/'
+    conv = tuple(reader.get_tensor(conv_scope + name) for name in ['Wt', 'Wr', 'Wl', 'b_conv'])
+    hidden = [(reader.get_tensor(prefix + '/hidden/weights'),
+               reader.get_tensor(prefix + '/hidden/biases'))]
+    return conv, hidden
+
+
+def tree_windows(tree, embeddings):
+    """Return the (x_t, x_r, x_l) inputs of every convolution window of a tree,
+    each shaped (num_nodes x feature_size), in the BFS order of sampling.py.
+    embeddings must be a numpy array.
+
+    A node with n children contributes child i (0-based) to the right input
+    with weight i / (n - 1) and to the left input with the remainder; a single
+    child is split evenly, as in network.eta_r and network.eta_l."""
+    kinds = []
+    parents, childs, right = [], [], []
+    queue = deque([(tree, -1)])
+    while queue:
+        node, _ = queue.popleft()
+        node_ind = len(kinds)
+        kinds.append(int(node['node']))
+        n = len(node['children'])
+        for i, child in enumerate(node['children']):
+            child_ind = node_ind + len(queue) + 1 + i
+            parents.append(node_ind)
+            childs.append(child_ind)
+            right.append(0.5 if n == 1 else float(i) / (n - 1))
+        queue.extend([(child, node_ind) for child in node['children']])
+
+    features = embeddings[kinds]
+    x_r = np.zeros_like(features)
+    x_l = np.zeros_like(features)
+    if parents:
+        right = np.array(right, dtype=np.float32)[:, None]
+        np.add.at(x_r, parents, right * features[childs])
+        np.add.at(x_l, parents, (1.0 - right) * features[childs])
+    return features, x_r, x_l
+
+
+def batch_windows(trees, embeddings):
+    """Stack the windows of several trees. Returns (x, offsets) where x is
+    (total_nodes x 3 * feature_size) laid out as [x_t, x_r, x_l] and offsets
+    holds the first row of every tree."""
+    embeddings = np.asarray(embeddings, dtype=np.float32)
+    windows = [np.concatenate(tree_windows(tree, embeddings), axis=1) for tree in trees]
+    offsets = np.cumsum([0] + [len(w) for w in windows[:-1]])
+    return np.concatenate(windows, axis=0), offsets
+
+
+def conv_weights(conv):
+    """Stack (w_t, w_r, w_l, b_conv) into one (3 * feature_size x output_size)
+    matrix matching the layout of batch_windows."""
+    w_t, w_r, w_l, b_conv = conv
+    return np.concatenate([w_t, w_r, w_l], axis=0), b_conv
+
+
+def lrelu(x, alpha=0.01):
+    return np.maximum(x, 0) - alpha * np.maximum(-x, 0)
+
+
+def softmax(x):
+    e = np.exp(x - np.max(x, axis=1, keepdims=True))
+    return e / np.sum(e, axis=1, keepdims=True)
+
+
+def forward(trees, embeddings, conv, hidden):
+    """Return the pooled vectors and class probabilities of trees."""
+    x, offsets = batch_windows(trees, embeddings)
+    weights, b_conv = conv_weights(conv)
+    conv_out = np.tanh(x.dot(weights) + b_conv)
+    pooled = np.maximum.reduceat(conv_out, offsets, axis=0)
+    out = pooled
+    for w, b in hidden:
+        out = lrelu(out.dot(w) + b)
+    return pooled, softmax(out)
@@ -0,0 +1,221 @@
+"""Data-parallel training over several processes, on one machine or several.
+
+Every worker trains on its own shard of the data. After each batch the
+gradients of all workers are averaged with a ring all-reduce over TCP and
+every worker applies the same averaged gradients, so all copies of the model
+stay identical. The effective batch size is the per-worker batch size times
+the number of workers.
+
+Rank 0 broadcasts its initial (or restored) variables before training starts
+and is the only one writing checkpoints and summaries, so the checkpoints are
+the usual cnn_tree.ckpt files."""
+
+import sys
+import time
+import socket
+import threading
+import subprocess
+import numpy as np
+import tensorflow as tf
+import runtime_config as runtime_config
+
+DEFAULT_PORT = 29500
+CONNECT_TIMEOUT = 120
+
+
+def add_arguments(parser):
+    """Add the data-parallel flags to a trainer's argument parser."""
+    group = parser.add_argument_group('data-parallel training')
+    group.add_argument('--workers', type=int, default=1,
+                       help='launch this many local worker processes')
+    group.add_argument('--rank', type=int, default=None,
+                       help='rank of this worker, when starting workers by hand')
+    group.add_argument('--world-size', type=int, default=1,
+                       help='total number of workers, when starting workers by hand')
+    group.add_argument('--hosts', default='127.0.0.1',
+                       help='comma separated host of every rank, or one host for all ranks')
+    group.add_argument('--port', type=int, default=DEFAULT_PORT,
+                       help='rank r listens on port + r')
+
+
+def launch_workers(args):
+    """If --workers asks for several local workers and this is not one of
+    them, re-run the command line once per rank and return the exit status.
+    Returns None in the worker processes themselves. With --pin-workers of
+    runtime_config.py, every worker gets its own cores."""
+    if args.workers <= 1 or args.rank is not None:
+        return None
+    cpus = runtime_config.worker_cpus(args.workers) if getattr(args, 'pin_workers', False) else None
+    procs = [
+        subprocess.Popen([sys.executable] + sys.argv + [
+            '--rank', str(rank), '--world-size', str(args.workers), '--hosts', '127.0.0.1',
+        ] + (['--cpus', runtime_config.format_cpus(cpus[rank])] if cpus else []))
+        for rank in range(args.workers)
+    ]
+    return max(proc.wait() for proc in procs)
+
+
+def connect(args):
+    """Return the RingAllReduce of this worker, or None when training in a
+    single process."""
+    if args.rank is None or args.world_size <= 1:
+        return None
+    hosts = args.hosts.split(',')
+    if len(hosts) == 1:
+        hosts = hosts * args.world_size
+    if len(hosts) != args.world_size:
+        raise ValueError('--hosts needs one host or one host per rank')
+    return RingAllReduce(args.rank, hosts, args.port)
+
+
+def session_config(comm, config=None):
+    """Split the cores of a machine, or the THREADS of parameters.py, between
+    the workers running on it, see runtime_config.session_config."""
+    return runtime_config.session_config(config, comm.local_size if comm is not None else 1)
+
+
+def shard(items, comm):
+    """Return the part of items trained on by this worker. Every worker gets
+    the same number of items, so that all of them run the same number of
+    steps; up to world_size - 1 items are dropped."""
+    if comm is None:
+        return items
+    size = len(items) // comm.world_size
+    return items[comm.rank::comm.world_size][:size]
+
+
+def is_chief(comm):
+    return comm is None or comm.rank == 0
+
+
+def _flatten(arrays):
+    return np.concatenate([np.ravel(a) for a in arrays]).astype(np.float32)
+
+
+def _unflatten(flat, like):
+    """Split a flat array into arrays shaped like the arrays of like."""
+    results, offset = [], 0
+    for a in like:
+        size = np.size(a)
+        results.append(flat[offset:offset + size].reshape(np.shape(a)))
+        offset += size
+    return results
+
+
+class RingAllReduce(object):
+    """Connects rank r to rank r + 1 and rank r - 1 of a ring of workers."""
+
+    def __init__(self, rank, hosts, port=DEFAULT_PORT):
+        self.rank = rank
+        self.world_size = len(hosts)
+        self.local_size = hosts.count(hosts[rank])
+
+        listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        listener.bind(('', port + rank))
+        listener.listen(1)
+
+        next_rank = (rank + 1) % self.world_size
+        deadline = time.time() + CONNECT_TIMEOUT
+        while True:
+            try:
+                self.next = socket.create_connection((hosts[next_rank], port + next_rank))
+                break
+            except socket.error:
+                if time.time() > deadline:
+                    raise
+                time.sleep(0.1)
+        self.prev, _ = listener.accept()
+        listener.close()
+        for sock in [self.next, self.prev]:
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def _recv(self, size):
+        """Receive size float32 values from the previous rank."""
+        buf = bytearray(size * 4)
+        view = memoryview(buf)
+        received = 0
+        while received < len(buf):
+            n = self.prev.recv_into(view[received:])
+            if not n:
+                raise IOError('Worker ' + str((self.rank - 1) % self.world_size) + ' disconnected')
+            received += n
+        return np.frombuffer(buf, dtype=np.float32)
+
+    def _exchange(self, send, size):
+        """Send an array to the next rank while receiving from the previous one."""
+        sender = threading.Thread(target=self.next.sendall, args=(send.tobytes(),))
+        sender.start()
+        received = self._recv(size)
+        sender.join()
+        return received
+
+    def allreduce_mean(self, arrays):
+        """Average a list of arrays over all workers."""
+        chunks = np.array_split(_flatten(arrays), self.world_size)
+        n = self.world_size
+        # reduce-scatter: after n - 1 steps chunk (rank + 1) % n holds the sum
+        for step in range(n - 1):
+            send = (self.rank - step) % n
+            recv = (self.rank - step - 1) % n
+            chunks[recv] = chunks[recv] + self._exchange(chunks[send], len(chunks[recv]))
+        # all-gather the summed chunks around the ring
+        for step in range(n - 1):
+            send = (self.rank + 1 - step) % n
+            recv = (self.rank - step) % n
+            chunks[recv] = self._exchange(chunks[send], len(chunks[recv]))
+        return _unflatten(np.concatenate(chunks) / n, arrays)
+
+    def broadcast(self, arrays):
+        """Return the arrays of rank 0 on every worker."""
+        flat = _flatten(arrays)
+        if self.rank != 0:
+            flat = self._recv(len(flat))
+        if self.rank != self.world_size - 1:
+            self.next.sendall(flat.tobytes())
+        return _unflatten(flat, arrays)
+
+    def close(self):
+        self.next.close()
+        self.prev.close()
+
+
+class GradientStep(object):
+    """optimizer.minimize(loss) split into computing the gradients and
+    applying them, so that they can be averaged between workers or
+    accumulated over micro-batches in between. The optimizer
+    creates the same variables as with minimize, so checkpoints are
+    interchangeable."""
+
+    def __init__(self, optimizer, loss, var_list=None):
+        grads_and_vars = [(g, v) for g, v in optimizer.compute_gradients(loss, var_list=var_list)
+                          if g is not None]
+        self.grads = [g for g, _ in grads_and_vars]
+        self.placeholders = [tf.placeholder(tf.float32, v.get_shape()) for _, v in grads_and_vars]
+        self.apply_op = optimizer.apply_gradients(
+            [(p, v) for p, (_, v) in zip(self.placeholders, grads_and_vars)])
+
+    def apply(self, sess, grads):
+        sess.run(self.apply_op, feed_dict=dict(zip(self.placeholders, grads)))
+
+
+def accumulate(total, grads, weight):
+    """Add grads scaled by weight to the running sum total (None at first).
+    With the loss averaged over a batch, weighting every micro-batch by its
+    share of the samples gives the gradients of the whole batch. That holds
+    because every tree is encoded the same whatever it is padded to (see
+    network.pooling_layer), and only for losses that are a mean over the
+    samples; drop out masks still differ from those of the whole batch."""
+    if total is None:
+        return [g * weight for g in grads]
+    for t, g in zip(total, grads):
+        t += g * weight
+    return total
+
+
+def broadcast_variables(sess, comm):
+    """Overwrite the variables of every worker with those of rank 0."""
+    variables = tf.global_variables()
+    values = comm.broadcast(sess.run(variables))
+    for var, value in zip(variables, values):
+        var.load(value.astype(var.dtype.base_dtype.as_numpy_dtype), sess)
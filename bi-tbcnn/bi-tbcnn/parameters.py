@@ -1,10 +1,30 @@
-"""Tuning hyperparameters for the cnn network."""
+"""Tuning hyperparameters for the cnn network. Every value can be overridden
+by an environment variable of the same name prefixed with TBCNN_, e.g.
+TBCNN_LEARN_RATE=0.0003, as sweep.py does for its trials."""
 
-LEARN_RATE = 0.001
-EPOCHS = 100
-CHECKPOINT_EVERY = 100
+import os
 
-BATCH_SIZE = 10
 
-TEST_BATCH_SIZE = 1
-DROP_OUT = 0.7
+def _env(name, default):
+    value = os.environ.get('TBCNN_' + name)
+    if value is None:
+        return default
+    if isinstance(default, int):
+        # sweep.py samples integers from continuous ranges too
+        return int(round(float(value)))
+    return type(default)(value)
+
+
+LEARN_RATE = _env('LEARN_RATE', 0.001)
+EPOCHS = _env('EPOCHS', 100)
+CHECKPOINT_EVERY = _env('CHECKPOINT_EVERY', 100)
+
+BATCH_SIZE = _env('BATCH_SIZE', 10)
+
+TEST_BATCH_SIZE = _env('TEST_BATCH_SIZE', 1)
+DROP_OUT = _env('DROP_OUT', 0.7)
+
+INFERENCE_BATCH_SIZE = _env('INFERENCE_BATCH_SIZE', 32)
+
+# threads of a TensorFlow session, 0 for one per core
+THREADS = _env('THREADS', 0)
@@ -0,0 +1,187 @@
+"""Classify trees with a Bi-TBCNN by scoring them against class prototypes.
+
+Instead of pairing a query with many trees of the other language and running
+both towers for every pair, a few representative pooled vectors are picked
+per label once ("build"). A query is then encoded once by its own tower and
+compared with all prototypes in a single batch through the hidden layers,
+which gives a ranking of the labels ("rank", "evaluate").
+
+Prototypes are the trees closest to the k-means centroids of the pooled
+vectors of each label, so they are real encodings the hidden layers have
+seen during training."""
+
+import sys
+import time
+import pickle
+import random
+import argparse
+import numpy as np
+from sklearn.metrics import accuracy_score
+import fast_parser
+from inference import BiTreeEncoder
+from export_vectors import load_trees
+from parameters import INFERENCE_BATCH_SIZE
+
+OTHER_SIDE = {'left': 'right', 'right': 'left'}
+
+
+def kmeans_prototypes(vectors, k, iterations=20, seed=0):
+    """Return the indices of up to k vectors closest to the k-means centroids."""
+    if len(vectors) <= k:
+        return list(range(len(vectors)))
+    rng = random.Random(seed)
+    centroids = vectors[rng.sample(range(len(vectors)), k)]
+    for _ in range(iterations):
+        dists = ((vectors[:, None, :] - centroids[None, :, :]) ** 2).sum(axis=2)
+        assignment = np.argmin(dists, axis=1)
+        for c in range(k):
+            members = vectors[assignment == c]
+            if len(members):
+                centroids[c] = members.mean(axis=0)
+    dists = ((vectors[:, None, :] - centroids[None, :, :]) ** 2).sum(axis=2)
+    return sorted(set(int(i) for i in np.argmin(dists, axis=0)))
+
+
+def build_prototypes(encoder, trees, side, per_label, batch_size=INFERENCE_BATCH_SIZE):
+    """Encode trees with the tower of side and pick per_label prototypes for
+    every label."""
+    vectors = encoder.encode([t['tree'] for t in trees], side, batch_size)
+    labels = [t['label'] for t in trees]
+    prototypes = {'side': side, 'labels': [], 'vectors': []}
+    for label in sorted(set(labels)):
+        members = vectors[[i for i, l in enumerate(labels) if l == label]]
+        for i in kmeans_prototypes(members, per_label):
+            prototypes['labels'].append(label)
+            prototypes['vectors'].append(members[i])
+    prototypes['vectors'] = np.array(prototypes['vectors'])
+    return prototypes
+
+
+def rank_labels(encoder, prototypes, query_vectors, batch_size=INFERENCE_BATCH_SIZE):
+    """Return, for every pooled query vector, the labels sorted by the best
+    similarity of their prototypes, as (label, similarity) pairs."""
+    proto_vectors = prototypes['vectors']
+    label_names = sorted(set(prototypes['labels']))
+    # prototype columns of every label
+    columns = [[i for i, l in enumerate(prototypes['labels']) if l == label] for label in label_names]
+    num_protos = len(proto_vectors)
+
+    rankings = []
+    # several queries per run, each tiled against every prototype
+    per_run = max(1, batch_size * 32 // num_protos)
+    for i in range(0, len(query_vectors), per_run):
+        queries = query_vectors[i:i + per_run]
+        tiled_queries = np.repeat(queries, num_protos, axis=0)
+        tiled_protos = np.tile(proto_vectors, (len(queries), 1))
+        if prototypes['side'] == 'right':
+            sims = encoder.similarity(tiled_queries, tiled_protos)
+        else:
+            sims = encoder.similarity(tiled_protos, tiled_queries)
+        for row in sims.reshape(len(queries), num_protos):
+            scores = [(label, float(np.max(row[cols]))) for label, cols in zip(label_names, columns)]
+            rankings.append(sorted(scores, key=lambda x: -x[1]))
+    return rankings
+
+
+def build(args):
+    encoder = BiTreeEncoder(args.logdir, args.left_embeddings, args.right_embeddings)
+    trees = load_trees(args.trees, args.split)
+    print('Encoding ' + str(len(trees)) + ' ' + args.side + ' trees...')
+    prototypes = build_prototypes(encoder, trees, args.side, args.per_label, args.batch_size)
+    encoder.close()
+    with open(args.outfile, 'wb') as fh:
+        pickle.dump(prototypes, fh, pickle.HIGHEST_PROTOCOL)
+    print('Wrote ' + str(len(prototypes['labels'])) + ' prototypes of ' +
+          str(len(set(prototypes['labels']))) + ' labels to ' + args.outfile)
+
+
+def load_prototypes(infile):
+    with open(infile, 'rb') as fh:
+        return pickle.load(fh)
+
+
+def rank(args):
+    prototypes = load_prototypes(args.prototypes)
+    encoder = BiTreeEncoder(args.logdir, args.left_embeddings, args.right_embeddings)
+    paths, trees = [], []
+    for path in args.files:
+        result = fast_parser.parse_file(path)
+        if result is None:
+            print(path + ': parse failed')
+            continue
+        paths.append(path)
+        trees.append(result[0])
+    vectors = encoder.encode(trees, OTHER_SIDE[prototypes['side']], args.batch_size)
+    for path, ranking in zip(paths, rank_labels(encoder, prototypes, vectors, args.batch_size)):
+        print(path + ' ' + ' '.join('%s:%.4f' % score for score in ranking[:args.top_k]))
+    encoder.close()
+
+
+def evaluate(args):
+    """Top-1 and top-k accuracy and throughput of prototype scoring on the
+    test trees of the query side."""
+    prototypes = load_prototypes(args.prototypes)
+    encoder = BiTreeEncoder(args.logdir, args.left_embeddings, args.right_embeddings)
+    trees = load_trees(args.trees, 'test')
+
+    start = time.time()
+    vectors = encoder.encode([t['tree'] for t in trees], OTHER_SIDE[prototypes['side']], args.batch_size)
+    encoded = time.time()
+    rankings = rank_labels(encoder, prototypes, vectors, args.batch_size)
+    end = time.time()
+    encoder.close()
+
+    correct = [t['label'] for t in trees]
+    print('Prototypes: ' + str(len(prototypes['labels'])))
+    print('Top-1 accuracy: ' + str(accuracy_score(correct, [r[0][0] for r in rankings])))
+    print('Top-%d accuracy: %s' % (args.top_k, np.mean(
+        [label in [l for l, _ in r[:args.top_k]] for label, r in zip(correct, rankings)])))
+    print('Encoding: %.1f trees/sec, scoring: %.1f trees/sec, total: %.1f trees/sec' % (
+        len(trees) / (encoded - start), len(trees) / max(end - encoded, 1e-9),
+        len(trees) / (end - start)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command')
+
+    def model_args(command):
+        command.add_argument('logdir', help='directory holding the train_bitbcnn.py checkpoints')
+        command.add_argument('left_embeddings')
+        command.add_argument('right_embeddings')
+        command.add_argument('--batch-size', type=int, default=INFERENCE_BATCH_SIZE)
+
+    build_cmd = commands.add_parser('build', help='pick prototypes from labelled trees')
+    model_args(build_cmd)
+    build_cmd.add_argument('trees', help='trees pickle of the prototype side, e.g. vec/fast_algorithms_trees_java.pkl')
+    build_cmd.add_argument('outfile')
+    build_cmd.add_argument('--side', default='right', choices=['left', 'right'],
+                           help='tower encoding the prototype trees')
+    build_cmd.add_argument('--per-label', type=int, default=5)
+    build_cmd.add_argument('--split', default='train', choices=['train', 'test', 'all'])
+
+    rank_cmd = commands.add_parser('rank', help='rank the labels of source files')
+    model_args(rank_cmd)
+    rank_cmd.add_argument('prototypes')
+    rank_cmd.add_argument('files', nargs='+')
+    rank_cmd.add_argument('--top-k', type=int, default=3)
+
+    eval_cmd = commands.add_parser('evaluate', help='accuracy on the test trees of the query side')
+    model_args(eval_cmd)
+    eval_cmd.add_argument('prototypes')
+    eval_cmd.add_argument('trees', help='trees pickle of the query side')
+    eval_cmd.add_argument('--top-k', type=int, default=3)
+
+    args = parser.parse_args()
+    if args.command == 'build':
+        build(args)
+    elif args.command == 'rank':
+        rank(args)
+    elif args.command == 'evaluate':
+        evaluate(args)
+    else:
+        parser.print_help()
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,124 @@
+"""Post-training int8 quantization of the TBCNN classifier.
+
+Weights are quantized symmetrically per output channel. The input of every
+layer is quantized symmetrically with one static scale, derived from the
+activations of a calibration sample run through the float model. Products
+are accumulated in int32 and rescaled to float before the non-linearities,
+so tanh, max pooling and softmax stay in float."""
+
+import pickle
+import hashlib
+import numpy as np
+import numpy_network as numpy_network
+
+INT8_MAX = 127
+
+
+def quantize_per_channel(weights):
+    """Quantize an (input_size x output_size) matrix with one scale per output."""
+    scales = np.max(np.abs(weights), axis=0) / INT8_MAX
+    scales[scales == 0] = 1.0
+    quantized = np.clip(np.round(weights / scales), -INT8_MAX, INT8_MAX).astype(np.int8)
+    return quantized, scales.astype(np.float32)
+
+
+def quantize_tensor(x, scale):
+    return np.clip(np.round(x / scale), -INT8_MAX, INT8_MAX).astype(np.int8)
+
+
+def int_gemm(a, b):
+    """Exact int32 product of two int8 matrices. numpy has no int8 BLAS, but
+    float32 holds every partial sum exactly while k * 127 * 127 < 2**24, so
+    the float32 BLAS is used whenever that bound holds."""
+    if a.shape[1] * INT8_MAX * INT8_MAX < 2 ** 24:
+        return a.astype(np.float32).dot(b.astype(np.float32)).astype(np.int32)
+    return a.astype(np.int32).dot(b.astype(np.int32))
+
+
+def calibrate(trees, embeddings, conv, hidden, percentile=99.99, batch_size=64):
+    """Run trees through the float model and return the scale of the input
+    of the convolution and of every hidden layer."""
+    weights, b_conv = numpy_network.conv_weights(conv)
+    ranges = [0.0] * (1 + len(hidden))
+    for i in range(0, len(trees), batch_size):
+        x, offsets = numpy_network.batch_windows(trees[i:i + batch_size], embeddings)
+        inputs = [x]
+        out = np.maximum.reduceat(np.tanh(x.dot(weights) + b_conv), offsets, axis=0)
+        for w, b in hidden:
+            inputs.append(out)
+            out = numpy_network.lrelu(out.dot(w) + b)
+        for j, layer_input in enumerate(inputs):
+            ranges[j] = max(ranges[j], float(np.percentile(np.abs(layer_input), percentile)))
+    return [max(r, 1e-8) / INT8_MAX for r in ranges]
+
+
+def quantize_model(labels, conv, hidden, input_scales):
+    """Build the int8 model from float weights and calibrated input scales."""
+    weights, b_conv = numpy_network.conv_weights(conv)
+    conv_q, conv_scales = quantize_per_channel(weights)
+    model = {
+        'labels': list(labels),
+        'conv': (conv_q, conv_scales, input_scales[0], b_conv),
+        'hidden': [],
+    }
+    for (w, b), scale in zip(hidden, input_scales[1:]):
+        w_q, w_scales = quantize_per_channel(w)
+        model['hidden'].append((w_q, w_scales, scale, b))
+    return model
+
+
+def save_model(model, outfile):
+    with open(outfile, 'wb') as fh:
+        pickle.dump(model, fh, pickle.HIGHEST_PROTOCOL)
+
+
+def load_model(modelfile):
+    with open(modelfile, 'rb') as fh:
+        return pickle.load(fh)
+
+
+def forward(trees, embeddings, model):
+    """Return the pooled vectors and class probabilities of trees, computed
+    with int8 matrix products."""
+    x, offsets = numpy_network.batch_windows(trees, embeddings)
+    w_q, w_scales, x_scale, b_conv = model['conv']
+    acc = int_gemm(quantize_tensor(x, x_scale), w_q)
+    pooled = np.maximum.reduceat(np.tanh(acc * (x_scale * w_scales) + b_conv), offsets, axis=0)
+    out = pooled
+    for w_q, w_scales, x_scale, b in model['hidden']:
+        acc = int_gemm(quantize_tensor(out, x_scale), w_q)
+        out = numpy_network.lrelu(acc * (x_scale * w_scales) + b)
+    return pooled, numpy_network.softmax(out)
+
+
+class QuantizedClassifier(object):
+    """Same interface as inference.TreeClassifier, backed by an int8 model
+    written by quantize_tbcnn.py."""
+
+    def __init__(self, modelfile, embedfile):
+        self.model = load_model(modelfile)
+        self.labels = self.model['labels']
+        with open(embedfile, 'rb') as fh:
+            embeddings, _ = pickle.load(fh)
+        self.embeddings = np.asarray(embeddings, dtype=np.float32)
+
+    def encode(self, trees, batch_size):
+        if not trees:
+            return np.zeros((0, 0)), np.zeros((0, len(self.labels)))
+        results = [forward(trees[i:i + batch_size], self.embeddings, self.model)
+                   for i in range(0, len(trees), batch_size)]
+        return (np.concatenate([r[0] for r in results], axis=0),
+                np.concatenate([r[1] for r in results], axis=0))
+
+    def predict(self, trees, batch_size):
+        return self.encode(trees, batch_size)[1]
+
+    def digest(self):
+        """Identifies the int8 model, its labels included, and the
+        embeddings, see tree_cache.CachedClassifier."""
+        digest = hashlib.sha1(pickle.dumps(self.model, 2))
+        digest.update(np.ascontiguousarray(self.embeddings).tobytes())
+        return digest.hexdigest()
+
+    def close(self):
+        pass
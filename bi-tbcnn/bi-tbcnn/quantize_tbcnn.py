@@ -0,0 +1,106 @@
+"""Quantize a TBCNN classifier trained by train_tbcnn.py to int8.
+
+A sample of the training trees is run through the float model to calibrate
+the activation scales, the int8 model is written to outfile, and the test
+trees are classified by the float and the int8 model to compare accuracy and
+throughput. The int8 model can be used by classify_directory.py --int8."""
+
+import time
+import random
+import pickle
+import argparse
+import numpy as np
+from sklearn.metrics import accuracy_score, precision_recall_fscore_support
+import numpy_network as numpy_network
+import quantization as quantization
+from inference import TreeClassifier, load_labels
+from parameters import INFERENCE_BATCH_SIZE
+
+
+def timed_predictions(predict, trees):
+    """Return (predicted label indices, trees/sec)."""
+    start = time.time()
+    probs = predict(trees)
+    return list(np.argmax(probs, axis=1)), len(trees) / (time.time() - start)
+
+
+def print_comparison(labels, correct_labels, results):
+    """Print accuracy, throughput and per-label precision/recall/f1 of every
+    (name, predictions, trees/sec) result side by side."""
+    names = [name for name, _, _ in results]
+    print('%-12s' % '' + ''.join('%24s' % name for name in names))
+    print('%-12s' % 'accuracy' + ''.join(
+        '%24.4f' % accuracy_score(correct_labels, predictions) for _, predictions, _ in results))
+    print('%-12s' % 'trees/sec' + ''.join('%24.1f' % speed for _, _, speed in results))
+    print('')
+    print('%-12s' % 'label' + ''.join('%24s' % 'precision/recall/f1' for _ in names))
+    scores = [precision_recall_fscore_support(correct_labels, predictions,
+                                              labels=list(range(len(labels))))
+              for _, predictions, _ in results]
+    for i, label in enumerate(labels):
+        print('%-12s' % label + ''.join(
+            '%24s' % ('%.2f/%.2f/%.2f' % (p[i], r[i], f[i])) for p, r, f, _ in scores))
+
+
+def quantize_tbcnn(logdir, embedfile, infile, outfile, calibration_size=500,
+                   percentile=99.99, batch_size=INFERENCE_BATCH_SIZE, evaluate=True):
+    with open(infile, 'rb') as fh:
+        trees, test_trees, _ = pickle.load(fh)
+    labels = load_labels(logdir, infile)
+    with open(embedfile, 'rb') as fh:
+        embeddings, _ = pickle.load(fh)
+    embeddings = np.asarray(embeddings, dtype=np.float32)
+
+    conv, hidden = numpy_network.load_checkpoint_weights(logdir)
+    sample = random.Random(0).sample(trees, min(calibration_size, len(trees)))
+    print('Calibrating on ' + str(len(sample)) + ' training trees...')
+    input_scales = quantization.calibrate(
+        [t['tree'] for t in sample], embeddings, conv, hidden, percentile)
+    model = quantization.quantize_model(labels, conv, hidden, input_scales)
+    quantization.save_model(model, outfile)
+    print('Int8 model written to ' + outfile)
+
+    if not evaluate:
+        return
+
+    test = [t['tree'] for t in test_trees]
+    correct_labels = [labels.index(t['label']) for t in test_trees]
+
+    classifier = TreeClassifier(logdir, embedfile, labels)
+    float_tf = timed_predictions(lambda x: classifier.predict(x, batch_size), test)
+    classifier.close()
+
+    def batched(forward):
+        return lambda x: np.concatenate(
+            [forward(x[i:i + batch_size])[1] for i in range(0, len(x), batch_size)], axis=0)
+
+    float_np = timed_predictions(
+        batched(lambda x: numpy_network.forward(x, embeddings, conv, hidden)), test)
+    int8_np = timed_predictions(
+        batched(lambda x: quantization.forward(x, embeddings, model)), test)
+
+    print_comparison(labels, correct_labels, [
+        ('float (tensorflow)', float_tf[0], float_tf[1]),
+        ('float (numpy)', float_np[0], float_np[1]),
+        ('int8 (numpy)', int8_np[0], int8_np[1]),
+    ])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir', help='directory holding the train_tbcnn.py checkpoints')
+    parser.add_argument('embeddings')
+    parser.add_argument('trees', help='training trees pickle, for calibration and evaluation')
+    parser.add_argument('outfile', help='int8 model to write')
+    parser.add_argument('--calibration-size', type=int, default=500)
+    parser.add_argument('--percentile', type=float, default=99.99,
+                        help='percentile of absolute activations mapped to 127')
+    parser.add_argument('--batch-size', type=int, default=INFERENCE_BATCH_SIZE)
+    parser.add_argument('--no-eval', action='store_true')
+    args = parser.parse_args()
+
+    quantize_tbcnn(args.logdir, args.embeddings, args.trees, args.outfile,
+                   args.calibration_size, args.percentile, args.batch_size, not args.no_eval)
+
+if __name__ == "__main__":
+    main()
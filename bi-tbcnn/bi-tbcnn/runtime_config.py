@@ -0,0 +1,167 @@
+"""Threads, cores and NUMA placement of the TensorFlow processes.
+
+By default TensorFlow sizes both of its thread pools to all the cores of the
+machine and lets the kernel move its threads and memory freely, which on a
+multi-socket host oversubscribes the cores and reads memory across sockets.
+With these flags a process:
+
+- runs its ops on --intra-op-threads threads, and --inter-op-threads ops at
+  a time (by default its cores, and 2),
+- only runs on the cores of --cpus, e.g. 0-7,16-23,
+- with --numa-node N, only runs on the cores of NUMA node N and allocates
+  its memory there (strictly with numactl if installed, otherwise by the
+  kernel's default local allocation),
+- with --pin-workers, gives each local data-parallel worker of --workers
+  its own slice of the cores, NUMA node by NUMA node.
+
+Every session made by parallel.session_config follows these settings."""
+
+import os
+import sys
+import glob
+import subprocess
+import multiprocessing
+import tensorflow as tf
+from parameters import THREADS
+
+NUMA_ENV = 'TBCNN_NUMA_BOUND'
+
+# set by apply()
+_settings = {'intra': None, 'inter': None, 'pinned': False}
+
+
+def add_arguments(parser):
+    """Add the runtime flags to a script's argument parser."""
+    group = parser.add_argument_group('threads and placement')
+    group.add_argument('--intra-op-threads', type=int, default=None,
+                       help='threads running the inside of an op (default: the usable cores)')
+    group.add_argument('--inter-op-threads', type=int, default=None,
+                       help='ops run at the same time (default: 2)')
+    group.add_argument('--cpus', default=None, metavar='LIST',
+                       help='only run on these cores, e.g. 0-7,16-23')
+    group.add_argument('--numa-node', type=int, default=None,
+                       help='only run on the cores and memory of this NUMA node')
+    group.add_argument('--pin-workers', action='store_true',
+                       help='give every local --workers process its own cores')
+
+
+def parse_cpus(text):
+    """[0, 1, 2, 3, 8] from '0-3,8'."""
+    cpus = []
+    for part in text.split(','):
+        part = part.strip()
+        if not part:
+            continue
+        if '-' in part:
+            first, last = part.split('-')
+            cpus.extend(range(int(first), int(last) + 1))
+        else:
+            cpus.append(int(part))
+    return sorted(set(cpus))
+
+
+def format_cpus(cpus):
+    return ','.join(str(cpu) for cpu in cpus)
+
+
+def numa_nodes():
+    """{node: [cpus]} of the machine, one node holding every core where
+    /sys tells nothing."""
+    nodes = {}
+    for path in glob.glob('/sys/devices/system/node/node[0-9]*/cpulist'):
+        node = int(os.path.basename(os.path.dirname(path))[len('node'):])
+        with open(path) as fh:
+            cpus = parse_cpus(fh.read())
+        if cpus:
+            nodes[node] = cpus
+    return nodes or {0: list(range(multiprocessing.cpu_count()))}
+
+
+def usable_cores():
+    """The cores this process may run on, NUMA node by NUMA node."""
+    if hasattr(os, 'sched_getaffinity'):
+        allowed = set(os.sched_getaffinity(0))
+    else:
+        allowed = None
+        try:
+            with open('/proc/self/status') as fh:
+                for line in fh:
+                    if line.startswith('Cpus_allowed_list:'):
+                        allowed = set(parse_cpus(line.split(':', 1)[1]))
+        except (IOError, OSError):
+            pass
+        if allowed is None:
+            allowed = set(range(multiprocessing.cpu_count()))
+    cores = [cpu for _, cpus in sorted(numa_nodes().items()) for cpu in cpus if cpu in allowed]
+    return cores or sorted(allowed)
+
+
+def set_affinity(cpus):
+    """Run this process, and the threads it starts from now on, on cpus."""
+    if hasattr(os, 'sched_setaffinity'):
+        os.sched_setaffinity(0, cpus)
+    else:
+        subprocess.check_call(['taskset', '-p', '-c', format_cpus(cpus), str(os.getpid())],
+                              stdout=open(os.devnull, 'w'))
+
+
+def _which(program):
+    for directory in os.environ.get('PATH', '').split(os.pathsep):
+        path = os.path.join(directory, program)
+        if os.path.isfile(path) and os.access(path, os.X_OK):
+            return path
+    return None
+
+
+def apply(args):
+    """Place this process as the flags of add_arguments ask. Call it first
+    thing in main(), before any session is made: with --numa-node and
+    numactl installed, the script is started again under numactl."""
+    if args.numa_node is not None and os.environ.get(NUMA_ENV) is None and _which('numactl'):
+        os.environ[NUMA_ENV] = str(args.numa_node)
+        node = str(args.numa_node)
+        os.execvp('numactl', ['numactl', '--cpunodebind=' + node, '--membind=' + node,
+                              sys.executable] + sys.argv)
+
+    cpus = None
+    if args.cpus is not None:
+        cpus = parse_cpus(args.cpus)
+    if args.numa_node is not None:
+        node_cpus = numa_nodes().get(args.numa_node)
+        if node_cpus is None:
+            raise ValueError('No NUMA node %d, the nodes are %s' % (args.numa_node, sorted(numa_nodes())))
+        cpus = [cpu for cpu in (cpus or node_cpus) if cpu in node_cpus]
+    if cpus is not None:
+        if not cpus:
+            raise ValueError('No core left to run on')
+        set_affinity(cpus)
+    _settings.update(intra=args.intra_op_threads, inter=args.inter_op_threads, pinned=cpus is not None)
+
+    # the OpenMP and MKL pools of numpy and TensorFlow builds linked to them
+    threads = str(args.intra_op_threads or len(usable_cores()))
+    for name in ('OMP_NUM_THREADS', 'MKL_NUM_THREADS'):
+        os.environ.setdefault(name, threads)
+
+
+def worker_cpus(workers):
+    """workers disjoint slices of the usable cores, for pinned local
+    data-parallel workers. The cores are in NUMA node order, so with as many
+    workers as nodes (or a multiple) no worker spans two nodes."""
+    cores = usable_cores()
+    if workers > len(cores):
+        raise ValueError('%d workers for %d cores' % (workers, len(cores)))
+    size = len(cores) // workers
+    return [cores[i * size:(i + 1) * size] for i in range(workers)]
+
+
+def session_config(config=None, local_size=1):
+    """Size the thread pools of config to the cores of this process, shared
+    with local_size - 1 other workers unless each was pinned to its own."""
+    if config is None:
+        config = tf.ConfigProto()
+    cores = THREADS or len(usable_cores())
+    if not _settings['pinned']:
+        cores = cores // local_size
+    config.intra_op_parallelism_threads = _settings['intra'] or max(1, cores)
+    config.inter_op_parallelism_threads = _settings['inter'] or 2
+    return config
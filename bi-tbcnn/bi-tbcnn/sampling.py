@@ -3,20 +3,22 @@
 import pickle
 import numpy as np
 import random
+from collections import deque
 from tqdm import *
 def gen_samples(trees, labels, vectors, vector_lookup):
     """Creates a generator that returns a tree in BFS order with each node
     replaced by its vector embedding, and a child lookup table."""
 
-    # encode labels as one-hot vectors
-    label_lookup = {label: _onehot(i, len(labels)) for i, label in enumerate(labels)}
+    # encode labels as one-hot vectors, built per tree so that many labels
+    # don't cost a label_size x label_size table at every batch
+    label_index = {label: i for i, label in enumerate(labels)}
     # print vector_lookup
 
     for tree in trees:
 
         nodes = []
         children = []
-        label = label_lookup[tree['label']]
+        label = _onehot(label_index[tree['label']], len(labels))
 
         queue = [(tree['tree'], -1)]
         # print queue
@@ -210,6 +212,41 @@ def gen_fast_samples(trees, labels, vectors, vector_lookup):
         # print "children list length: " + str(len(children))
         yield (nodes, children, label_one_hot)
 
+def gen_unlabelled_samples(trees, vectors):
+    """Same as gen_samples, but for trees without a label (e.g. freshly parsed
+    source files at inference time)."""
+
+    for tree in trees:
+        nodes = []
+        children = []
+        queue = deque([(tree, -1)])
+        while queue:
+            node, parent_ind = queue.popleft()
+            node_ind = len(nodes)
+            queue.extend([(child, node_ind) for child in node['children']])
+            children.append([])
+            if parent_ind > -1:
+                children[parent_ind].append(node_ind)
+            nodes.append(vectors[int(node['node'])])
+        yield (nodes, children)
+
+def batch_unlabelled_samples(gen, batch_size):
+    """Batch samples from gen_unlabelled_samples"""
+    nodes, children = [], []
+    for n, c in gen:
+        nodes.append(n)
+        children.append(c)
+        if len(nodes) >= batch_size:
+            yield _unlabelled(_pad_batch(nodes, children, []))
+            nodes, children = [], []
+
+    if nodes:
+        yield _unlabelled(_pad_batch(nodes, children, []))
+
+def _unlabelled(batch):
+    nodes, children, _, counts = batch
+    return nodes, children, counts
+
 def batch_siamese_samples(gen, batch_size):
     """Batch samples from a generator"""
     nodes, children, labels_one_hot, labels = [], [], [], []
@@ -252,13 +289,78 @@ def batch_samples(gen, batch_size):
         yield _pad_batch(nodes, children, labels)
 
 
+def tree_size(tree):
+    """Number of nodes of a tree."""
+    size = 0
+    stack = [tree]
+    while stack:
+        node = stack.pop()
+        size += 1
+        stack.extend(node['children'])
+    return size
+
+
+def balanced_indices(labels, count, rng=random):
+    """count indices of labels drawn at random so that every label is as
+    likely, and every sample of a label as well."""
+    by_label = {}
+    for i, label in enumerate(labels):
+        by_label.setdefault(label, []).append(i)
+    keys = sorted(by_label)
+    return [rng.choice(by_label[rng.choice(keys)]) for _ in range(count)]
+
+
+def cap_depth(tree, max_depth):
+    """Copy of a tree without the nodes deeper than max_depth (the root is at
+    depth 1)."""
+    root = {'node': tree['node'], 'children': []}
+    stack = [(tree, root, 1)]
+    while stack:
+        node, copy, depth = stack.pop()
+        if depth >= max_depth:
+            continue
+        for child in node['children']:
+            child_copy = {'node': child['node'], 'children': []}
+            copy['children'].append(child_copy)
+            stack.append((child, child_copy, depth + 1))
+    return root
+
+
+def micro_batches(sizes, batch_size, node_budget=None, max_samples=None):
+    """Split the sample indices 0..len(sizes)-1 into batches of batch_size
+    samples, each yielded as a list of micro-batches (lists of indices).
+
+    A micro-batch is padded to its largest tree, so it costs its number of
+    samples times that size; samples are sorted by size within a batch and
+    packed while that padded node count stays within node_budget, and at most
+    max_samples are packed together. A sample larger than the budget is a
+    micro-batch on its own. sizes holds the number of nodes of every sample,
+    or a tuple of them for samples made of several trees padded separately."""
+    sizes = [s if isinstance(s, tuple) else (s,) for s in sizes]
+    for start in range(0, len(sizes), batch_size):
+        indices = sorted(range(start, min(start + batch_size, len(sizes))), key=lambda i: sum(sizes[i]))
+        groups, group, largest = [], [], None
+        for i in indices:
+            grown = sizes[i] if largest is None else tuple(max(a, b) for a, b in zip(largest, sizes[i]))
+            full = max_samples is not None and len(group) >= max_samples
+            if group and (full or (node_budget is not None and (len(group) + 1) * sum(grown) > node_budget)):
+                groups.append(group)
+                group, grown = [], sizes[i]
+            group.append(i)
+            largest = grown
+        if group:
+            groups.append(group)
+        yield groups
+
+
 def _pad_batch_siamese_2_side(batch_left_nodes, batch_left_children,batch_left_labels_one_hot, batch_left_labels, batch_right_nodes, batch_right_children,batch_right_labels_one_hot, batch_right_labels):
     return _pad_batch_siamese(batch_left_nodes, batch_left_children,batch_left_labels_one_hot, batch_left_labels), _pad_batch_siamese(batch_right_nodes, batch_right_children,batch_right_labels_one_hot, batch_right_labels)
 
 
 def _pad_batch_siamese(nodes, children, labels_one_hot, labels):
     if not nodes:
-        return [], [], []
+        return [], [], [], [], []
+    counts = [len(n) for n in nodes]
     max_nodes = max([len(x) for x in nodes])
     max_children = max([len(x) for x in children])
     feature_len = len(nodes[0][0])
@@ -270,11 +372,14 @@ def _pad_batch_siamese(nodes, children, labels_one_hot, labels):
     # pad every child sample so every node has the same number of children
     children = [[c + [0] * (child_len - len(c)) for c in sample] for sample in children]
 
-    return nodes, children, labels_one_hot, labels
+    return nodes, children, labels_one_hot, labels, counts
 
 def _pad_batch(nodes, children, labels):
+    """Pads the trees of a batch to its largest tree. Also returns the
+    number of real nodes of each tree, to feed as network.node_counts."""
     if not nodes:
-        return [], [], []
+        return [], [], [], []
+    counts = [len(n) for n in nodes]
     max_nodes = max([len(x) for x in nodes])
     max_children = max([len(x) for x in children])
     feature_len = len(nodes[0][0])
@@ -286,7 +391,7 @@ def _pad_batch(nodes, children, labels):
     # pad every child sample so every node has the same number of children
     children = [[c + [0] * (child_len - len(c)) for c in sample] for sample in children]
 
-    return nodes, children, labels
+    return nodes, children, labels, counts
 
 def _onehot(i, total):
     return [1.0 if j == i else 0.0 for j in range(total)]
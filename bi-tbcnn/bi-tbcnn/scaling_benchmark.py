@@ -0,0 +1,192 @@
+"""Measure how TBCNN training or inference scales with the number of cores.
+
+Every point runs in its own process, pinned to the first N usable cores
+(NUMA node by NUMA node, so the points past the cores of one node show the
+cost of crossing sockets) with N intra-op threads, and times the same
+batches of trees, sampled and padded beforehand. The trees per second of
+every point, the speedup over the smallest point and the parallel
+efficiency are printed, and appended as JSON lines to --output.
+
+With --label-counts, the training throughput is measured instead for every
+number of labels, e.g. 10,100,500, on all the usable cores: the trees are
+given that many random labels, and every count is trained with the full
+softmax and, with --sampled-softmax N, with the sampled softmax of N labels
+(see train_tbcnn.py)."""
+
+import os
+import sys
+import json
+import time
+import pickle
+import argparse
+import subprocess
+import numpy as np
+import tensorflow as tf
+import network as network
+import sampling as sampling
+import runtime_config as runtime_config
+from parameters import LEARN_RATE, BATCH_SIZE
+
+
+def default_points(cores):
+    """1, 2, 4, ... up to and including cores."""
+    points, n = [], 1
+    while n < cores:
+        points.append(n)
+        n *= 2
+    return points + [cores]
+
+
+def run_point(infile, embedfile, mode, batch_size, steps, warmup, num_labels=None, num_sampled=0):
+    """Trees per second of steps timed batches, in this process. With
+    num_labels, the trees get that many random labels instead of theirs, and
+    with num_sampled the loss is the sampled softmax of that many labels."""
+    with open(infile, 'rb') as fh:
+        trees, _, labels = pickle.load(fh)
+    with open(embedfile, 'rb') as fh:
+        embeddings, embed_lookup = pickle.load(fh)
+
+    rng = np.random.RandomState(0)
+    if num_labels:
+        labels = ['label-%d' % i for i in range(num_labels)]
+        trees = [{'tree': tree['tree'], 'label': labels[rng.randint(num_labels)]} for tree in trees]
+    label_index = {label: i for i, label in enumerate(labels)}
+    batches = []
+    for _ in range(warmup + steps):
+        batch = [trees[i] for i in rng.randint(len(trees), size=batch_size)]
+        nodes, children, batch_labels, counts = next(sampling.batch_samples(
+            sampling.gen_samples(batch, labels, embeddings, embed_lookup), batch_size))
+        if num_sampled:
+            batch_labels = [label_index[tree['label']] for tree in batch]
+        batches.append((nodes, children, batch_labels, counts))
+
+    if num_sampled:
+        nodes_node, children_node, pooling_node, hidden_node, head = network.init_net_with_head(
+            len(embeddings[0]), len(labels))
+        labels_node, loss_node = network.sampled_loss_layer(pooling_node, head, len(labels), num_sampled)
+    else:
+        nodes_node, children_node, hidden_node = network.init_net(len(embeddings[0]), len(labels))
+        labels_node, loss_node = network.loss_layer(hidden_node, len(labels))
+    out_node = network.out_layer(hidden_node)
+    fetch = tf.train.AdamOptimizer(LEARN_RATE).minimize(loss_node) if mode == 'train' else out_node
+
+    sess = tf.Session(config=runtime_config.session_config())
+    sess.run(tf.global_variables_initializer())
+    for i, (nodes, children, batch_labels, counts) in enumerate(batches):
+        if i == warmup:
+            start = time.time()
+        feed_dict = {nodes_node: nodes, children_node: children,
+                     network.node_counts(nodes_node): counts}
+        if mode == 'train':
+            feed_dict[labels_node] = batch_labels
+        sess.run(fetch, feed_dict=feed_dict)
+    seconds = time.time() - start
+    sess.close()
+    return steps * batch_size / seconds
+
+
+def measure(infile, embedfile, cores, mode, batch_size, steps, warmup, inter_op_threads=None, extra_args=()):
+    """Trees per second of a point run in its own process on cores."""
+    command = [sys.executable, os.path.abspath(__file__), infile, embedfile, '--point',
+               '--mode', mode, '--batch-size', str(batch_size), '--steps', str(steps),
+               '--warmup', str(warmup), '--cpus', runtime_config.format_cpus(cores),
+               '--intra-op-threads', str(len(cores))] + list(extra_args)
+    if inter_op_threads is not None:
+        command += ['--inter-op-threads', str(inter_op_threads)]
+    out = subprocess.check_output(command)
+    return json.loads(out.decode('utf-8').strip().splitlines()[-1])['trees_per_sec']
+
+
+def benchmark(infile, embedfile, points, mode='train', batch_size=BATCH_SIZE, steps=20, warmup=3,
+              inter_op_threads=None, output=None):
+    cores = runtime_config.usable_cores()
+    points = [n for n in points if n <= len(cores)]
+    results = []
+    for n in points:
+        cpus = runtime_config.format_cpus(cores[:n])
+        trees_per_sec = measure(infile, embedfile, cores[:n], mode, batch_size, steps, warmup, inter_op_threads)
+        results.append({'mode': mode, 'cores': n, 'cpus': cpus, 'batch_size': batch_size,
+                        'trees_per_sec': trees_per_sec})
+        print('%3d cores: %.1f trees/sec' % (n, trees_per_sec))
+
+    base = results[0]
+    print('cores  trees/sec  speedup  efficiency')
+    for result in results:
+        result['speedup'] = result['trees_per_sec'] / base['trees_per_sec']
+        result['efficiency'] = result['speedup'] * base['cores'] / result['cores']
+        print('%5d  %9.1f  %7.2f  %9.0f%%' % (result['cores'], result['trees_per_sec'],
+                                              result['speedup'], 100 * result['efficiency']))
+    if output is not None:
+        with open(output, 'a') as fh:
+            for result in results:
+                fh.write(json.dumps(result, sort_keys=True) + '\n')
+    return results
+
+
+def label_benchmark(infile, embedfile, label_counts, num_sampled=0, batch_size=BATCH_SIZE, steps=20, warmup=3,
+                    inter_op_threads=None, output=None):
+    """Training trees per second for every number of labels of label_counts,
+    with the full softmax and the sampled softmax of num_sampled labels."""
+    cores = runtime_config.usable_cores()
+    results = []
+    for count in label_counts:
+        losses = [('full', [])]
+        if num_sampled and num_sampled < count:
+            losses.append(('sampled', ['--sampled-softmax', str(num_sampled)]))
+        for loss, extra_args in losses:
+            trees_per_sec = measure(infile, embedfile, cores, 'train', batch_size, steps, warmup,
+                                    inter_op_threads, ['--num-labels', str(count)] + extra_args)
+            results.append({'mode': 'train', 'labels': count, 'loss': loss, 'sampled': num_sampled if extra_args else 0,
+                            'cores': len(cores), 'batch_size': batch_size, 'trees_per_sec': trees_per_sec})
+            print('%4d labels, %s softmax: %.1f trees/sec' % (count, loss, trees_per_sec))
+
+    print('labels  loss      trees/sec')
+    for result in results:
+        print('%6d  %-8s  %9.1f' % (result['labels'], result['loss'], result['trees_per_sec']))
+    if output is not None:
+        with open(output, 'a') as fh:
+            for result in results:
+                fh.write(json.dumps(result, sort_keys=True) + '\n')
+    return results
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('inputs', help='trees pickle')
+    parser.add_argument('embeddings')
+    parser.add_argument('--cores', default=None,
+                        help='comma separated core counts to measure (default: 1, 2, 4, ... all)')
+    parser.add_argument('--mode', default='train', choices=['train', 'infer'])
+    parser.add_argument('--batch-size', type=int, default=BATCH_SIZE)
+    parser.add_argument('--steps', type=int, default=20, help='timed batches per point')
+    parser.add_argument('--warmup', type=int, default=3, help='untimed batches before them')
+    parser.add_argument('--label-counts', default=None, metavar='COUNTS',
+                        help='comma separated label counts to measure training at, e.g. 10,100,500')
+    parser.add_argument('--sampled-softmax', type=int, default=0, metavar='N',
+                        help='also measure the sampled softmax of N labels (with --point: train with it)')
+    parser.add_argument('--num-labels', type=int, default=None, help=argparse.SUPPRESS)
+    parser.add_argument('--output', default=None, metavar='FILE', help='append the results to FILE as JSON lines')
+    parser.add_argument('--point', action='store_true', help=argparse.SUPPRESS)
+    runtime_config.add_arguments(parser)
+    args = parser.parse_args()
+    runtime_config.apply(args)
+
+    if args.point:
+        trees_per_sec = run_point(args.inputs, args.embeddings, args.mode, args.batch_size,
+                                  args.steps, args.warmup, args.num_labels, args.sampled_softmax)
+        print(json.dumps({'trees_per_sec': trees_per_sec}))
+        return
+    if args.label_counts:
+        label_benchmark(args.inputs, args.embeddings, [int(n) for n in args.label_counts.split(',')],
+                        args.sampled_softmax, args.batch_size, args.steps, args.warmup,
+                        args.inter_op_threads, args.output)
+        return
+
+    points = ([int(n) for n in args.cores.split(',')] if args.cores
+              else default_points(len(runtime_config.usable_cores())))
+    benchmark(args.inputs, args.embeddings, points, args.mode, args.batch_size, args.steps, args.warmup,
+              args.inter_op_threads, args.output)
+
+
+if __name__ == "__main__":
+    main()
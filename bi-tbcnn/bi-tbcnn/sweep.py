@@ -0,0 +1,298 @@
+"""Run a hyperparameter sweep as concurrent training jobs on one machine.
+
+The search space is a JSON object mapping the environment variables of the
+two parameters.py files (TBCNN_LEARN_RATE, TBCNN_BATCH_SIZE, TBCNN_DROP_OUT,
+AST2VEC_NUM_FEATURES, ...) to either a list of values or a distribution:
+
+    {"TBCNN_LEARN_RATE": {"log_uniform": [0.0001, 0.01]},
+     "TBCNN_DROP_OUT": {"uniform": [0.5, 0.9]},
+     "TBCNN_BATCH_SIZE": [5, 10, 20]}
+
+With --trials, that many trials draw their values at random; otherwise
+every combination of the lists is a trial. Every trial runs the command
+given after --, in which {trial} is replaced by the directory of the trial,
+{metrics} by its metrics file and {NAME} by the value of NAME, e.g.
+
+    python sweep.py space.json sweep/ --cores-per-trial 4 -- \\
+        python train_tbcnn.py {trial} trees.pkl vectors.pkl True False \\
+        --validation 0.1 --eval-every 1 --metrics {metrics}
+
+The trials are pinned to disjoint sets of --cores-per-trial cores and their
+TensorFlow sessions use as many threads. They all read the same trees and
+embeddings pickles and only write to their own directory.
+
+The accuracies which the trainers append to the metrics file with
+--eval-every drive a median stopping rule: a trial whose best accuracy at an
+epoch is below the median of the best accuracies of the other trials at that
+epoch is stopped. leaderboard.tsv in the sweep directory lists the trials by
+best accuracy with their wall time. Give the trainers --validation, as
+above: without it they evaluate on the test trees, which are then used to
+pick the parameters and no longer measure the chosen model fairly.
+
+--memory-mb limits the data segment (RLIMIT_DATA) of every trial rather
+than its address space: TensorFlow reserves far more address space than it
+uses."""
+
+import os
+import sys
+import json
+import math
+import time
+import argparse
+import itertools
+import subprocess
+import multiprocessing
+import numpy as np
+
+
+def load_space(path):
+    with open(path) as fh:
+        return json.load(fh)
+
+
+def grid(space):
+    """Every combination of the values of space, which only holds lists."""
+    names = sorted(space)
+    for name in names:
+        if not isinstance(space[name], list):
+            raise ValueError(name + ' is a distribution, sample it with --trials')
+    return [dict(zip(names, values)) for values in itertools.product(*[space[n] for n in names])]
+
+
+def sample(space, trials, rng):
+    """trials random draws from space."""
+    configs = []
+    for _ in range(trials):
+        config = {}
+        for name in sorted(space):
+            value = space[name]
+            if isinstance(value, list):
+                config[name] = value[rng.randint(len(value))]
+            elif 'uniform' in value:
+                low, high = value['uniform']
+                config[name] = float(rng.uniform(low, high))
+            elif 'log_uniform' in value:
+                low, high = value['log_uniform']
+                config[name] = float(math.exp(rng.uniform(math.log(low), math.log(high))))
+            else:
+                raise ValueError('Unknown distribution of ' + name + ': ' + json.dumps(value))
+        configs.append(config)
+    return configs
+
+
+def available_cores():
+    if hasattr(os, 'sched_getaffinity'):
+        return sorted(os.sched_getaffinity(0))
+    return list(range(multiprocessing.cpu_count()))
+
+
+def launch(args, cores, logfile, env=None, memory_mb=None):
+    """Start args pinned to cores, with as many threads, its heap and other
+    private memory limited to memory_mb and its output written to logfile."""
+    env = dict(os.environ if env is None else env)
+    for name in ('TBCNN_THREADS', 'OMP_NUM_THREADS', 'MKL_NUM_THREADS'):
+        env[name] = str(len(cores))
+    if not hasattr(os, 'sched_setaffinity'):
+        args = ['taskset', '-c', ','.join(str(c) for c in cores)] + list(args)
+
+    def limit():
+        if hasattr(os, 'sched_setaffinity'):
+            os.sched_setaffinity(0, cores)
+        if memory_mb:
+            import resource
+            limit_bytes = memory_mb * 2 ** 20
+            resource.setrlimit(resource.RLIMIT_DATA, (limit_bytes, limit_bytes))
+
+    with open(logfile, 'w') as log:
+        return subprocess.Popen(args, env=env, stdout=log, stderr=subprocess.STDOUT, preexec_fn=limit)
+
+
+def core_slots(cores_per_trial, parallel=None):
+    """Disjoint sets of cores_per_trial of the available cores, at most parallel of them."""
+    cores = available_cores()
+    slots = [cores[i:i + cores_per_trial] for i in range(0, len(cores) - cores_per_trial + 1, cores_per_trial)]
+    if parallel is not None:
+        slots = slots[:parallel]
+    if not slots:
+        raise ValueError('%d cores per trial, only %d available' % (cores_per_trial, len(cores)))
+    return slots
+
+
+def read_accuracies(metrics_file):
+    """The (epoch, accuracy) evaluations in a metrics file, skipping the
+    throughput records and a line still being written."""
+    points = []
+    if not os.path.isfile(metrics_file):
+        return points
+    with open(metrics_file) as fh:
+        for line in fh:
+            try:
+                record = json.loads(line)
+            except ValueError:
+                continue
+            if 'accuracy' in record:
+                points.append((record['epoch'], record['accuracy']))
+    return points
+
+
+def best_at(points, epoch):
+    """Best accuracy of points up to epoch, or None if epoch is not reached."""
+    if not points or points[-1][0] < epoch:
+        return None
+    return max(accuracy for e, accuracy in points if e <= epoch)
+
+
+class Trial(object):
+
+    def __init__(self, index, params, outdir):
+        self.index = index
+        self.params = params
+        self.directory = os.path.join(outdir, 'trial-%03d' % index)
+        self.metrics = os.path.join(self.directory, 'metrics.jsonl')
+        self.process = None
+        self.cores = None
+        self.status = 'pending'
+        self.start = None
+        self.seconds = 0.0
+        self.points = []
+        self.checked_epoch = 0
+
+    def launch(self, command, cores, memory_mb):
+        if not os.path.isdir(self.directory):
+            os.makedirs(self.directory)
+        with open(os.path.join(self.directory, 'params.json'), 'w') as fh:
+            json.dump(self.params, fh, sort_keys=True, indent=2)
+        args = [part.format(trial=self.directory, metrics=self.metrics, **self.params) for part in command]
+        env = dict(os.environ)
+        env.update((name, str(value)) for name, value in self.params.items())
+        self.cores = cores
+        self.start = time.time()
+        self.status = 'running'
+        self.process = launch(args, cores, os.path.join(self.directory, 'log.txt'), env, memory_mb)
+        print('Trial %d on cores %s: %s' % (self.index, ','.join(str(c) for c in cores),
+                                             json.dumps(self.params, sort_keys=True)))
+
+    def poll(self):
+        """Read the new evaluations, return True once the process is over."""
+        self.points = read_accuracies(self.metrics)
+        if self.process.poll() is None:
+            self.seconds = time.time() - self.start
+            return False
+        self.seconds = time.time() - self.start
+        if self.status == 'running':
+            self.status = 'done' if self.process.returncode == 0 else 'failed (%d)' % self.process.returncode
+        return True
+
+    def stop(self):
+        self.status = 'stopped'
+        self.process.terminate()
+
+    def best(self):
+        return max(accuracy for _, accuracy in self.points) if self.points else None
+
+
+def should_stop(trial, trials, grace_epochs, min_peers):
+    """The median stopping rule, at the latest epoch trial was evaluated at."""
+    if not trial.points:
+        return False
+    epoch = trial.points[-1][0]
+    if epoch <= trial.checked_epoch or epoch < grace_epochs:
+        return False
+    trial.checked_epoch = epoch
+    peers = [best_at(other.points, epoch) for other in trials if other is not trial]
+    peers = [accuracy for accuracy in peers if accuracy is not None]
+    if len(peers) < min_peers:
+        return False
+    return best_at(trial.points, epoch) < np.median(peers)
+
+
+def write_leaderboard(outdir, trials):
+    ranked = sorted(trials, key=lambda t: (t.best() is None, -(t.best() or 0.0), t.seconds))
+    path = os.path.join(outdir, 'leaderboard.tsv')
+    with open(path + '.tmp', 'w') as fh:
+        fh.write('trial\tstatus\tbest_accuracy\tepochs\twall_secs\tparams\n')
+        for trial in ranked:
+            if trial.status == 'pending':
+                continue
+            fh.write('%d\t%s\t%s\t%s\t%.0f\t%s\n' % (
+                trial.index, trial.status,
+                '%.4f' % trial.best() if trial.points else '-',
+                trial.points[-1][0] if trial.points else '-',
+                trial.seconds, json.dumps(trial.params, sort_keys=True)))
+    os.rename(path + '.tmp', path)
+
+
+def sweep(space, outdir, command, trials=None, cores_per_trial=1, parallel=None, memory_mb=None,
+          grace_epochs=1, min_peers=2, seed=None, poll_secs=5):
+    rng = np.random.RandomState(seed)
+    configs = sample(space, trials, rng) if trials else grid(space)
+    slots = core_slots(cores_per_trial, parallel)
+    if not os.path.isdir(outdir):
+        os.makedirs(outdir)
+    print('%d trials, %d at a time on %d cores each' % (len(configs), len(slots), cores_per_trial))
+
+    all_trials = [Trial(i, config, outdir) for i, config in enumerate(configs)]
+    pending = list(all_trials)
+    running = []
+    try:
+        while pending or running:
+            while pending and slots:
+                trial = pending.pop(0)
+                trial.launch(command, slots.pop(0), memory_mb)
+                running.append(trial)
+            time.sleep(poll_secs)
+            for trial in list(running):
+                if trial.poll():
+                    running.remove(trial)
+                    slots.append(trial.cores)
+                    print('Trial %d %s, best accuracy %s after %.0f seconds'
+                          % (trial.index, trial.status, trial.best(), trial.seconds))
+                elif should_stop(trial, all_trials, grace_epochs, min_peers):
+                    print('Stopping trial %d, below the median at epoch %d'
+                          % (trial.index, trial.points[-1][0]))
+                    trial.stop()
+            write_leaderboard(outdir, all_trials)
+    finally:
+        for trial in running:
+            if trial.process.poll() is None:
+                trial.process.terminate()
+    write_leaderboard(outdir, all_trials)
+    print('Leaderboard written to ' + os.path.join(outdir, 'leaderboard.tsv'))
+    return all_trials
+
+
+def main():
+    if '--' not in sys.argv:
+        sys.exit('usage: sweep.py SPACE OUTDIR [options] -- COMMAND...')
+    split = sys.argv.index('--')
+    command = sys.argv[split + 1:]
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('space', help='search space JSON file')
+    parser.add_argument('outdir', help='directory of the trials and the leaderboard')
+    parser.add_argument('--trials', type=int, default=None,
+                        help='number of random trials, instead of the whole grid')
+    parser.add_argument('--cores-per-trial', type=int, default=1)
+    parser.add_argument('--parallel', type=int, default=None,
+                        help='most trials at a time, by default as many as the cores allow')
+    parser.add_argument('--memory-mb', type=int, default=None,
+                        help='limit the memory of every trial')
+    parser.add_argument('--grace-epochs', type=int, default=1,
+                        help='never stop a trial before this epoch')
+    parser.add_argument('--min-peers', type=int, default=2,
+                        help='trials reaching an epoch needed to stop another one at it')
+    parser.add_argument('--seed', type=int, default=None)
+    parser.add_argument('--poll-secs', type=float, default=5)
+    args = parser.parse_args(sys.argv[1:split])
+    if not command:
+        parser.error('no command after --')
+    if '--validation' not in command:
+        print('Warning: the trials are ranked on the accuracy of their test trees, '
+              'give the trainer --validation to hold out training trees instead')
+
+    sweep(load_space(args.space), args.outdir, command, args.trials, args.cores_per_trial, args.parallel,
+          args.memory_mb, args.grace_epochs, args.min_peers, args.seed, args.poll_secs)
+
+
+if __name__ == "__main__":
+    main()
@@ -5,10 +5,13 @@ import tensorflow as tf
 import numpy as np
 import network as network
 import sampling as sampling
+import tracing as tracing
+import runtime_config as runtime_config
 from parameters import LEARN_RATE, EPOCHS, CHECKPOINT_EVERY, TEST_BATCH_SIZE, DROP_OUT
 from sklearn.metrics import classification_report, confusion_matrix, accuracy_score
 import sys
 import json
+import argparse
 
 os.environ['CUDA_VISIBLE_DEVICES'] = '-1'
 
@@ -37,8 +40,11 @@ def get_trees_from_pairs(all_pairs):
     return left_trees, right_trees
 
 
-def test_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS):
-    """Train a classifier to label ASTs"""
+def test_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS, tracer=None):
+    """Train a classifier to label ASTs. Sampled batches are traced by tracer,
+    see tracing.Tracer."""
+    if tracer is None:
+        tracer = tracing.Tracer()
 
 
     n_classess = 2
@@ -95,7 +101,7 @@ def test_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS):
     # tf.summary.scalar('loss', loss_node)
 
     ### init the graph
-    sess = tf.Session()#config=tf.ConfigProto(device_count={'GPU':0}))
+    sess = tf.Session(config=runtime_config.session_config())#config=tf.ConfigProto(device_count={'GPU':0}))
     sess.run(tf.global_variables_initializer())
 
     with tf.name_scope('saver'):
@@ -120,21 +126,28 @@ def test_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS):
     correct_labels = []
     predictions = []
     print('Computing testing accuracy...')
-    for left_gen_batch, right_gen_batch in sampling.batch_random_samples_2_sides(left_trees, left_algo_labels, right_trees, right_algo_labels, left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup, using_vector_lookup_left, False, TEST_BATCH_SIZE):
-        left_nodes, left_children, left_labels_one_hot, left_labels = left_gen_batch
-
-        right_nodes, right_children, right_labels_one_hot, right_labels = right_gen_batch
+    batches = sampling.batch_random_samples_2_sides(left_trees, left_algo_labels, right_trees, right_algo_labels, left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup, using_vector_lookup_left, False, TEST_BATCH_SIZE)
+    for step in range((len(left_trees) + TEST_BATCH_SIZE - 1) // TEST_BATCH_SIZE):
+        tracer.begin_step(step, 'test')
+        with tracer.span('sampling'):
+            left_gen_batch, right_gen_batch = next(batches)
+        left_nodes, left_children, left_labels_one_hot, left_labels, left_counts = left_gen_batch
+
+        right_nodes, right_children, right_labels_one_hot, right_labels, right_counts = right_gen_batch
         sim_labels, _ = get_one_hot_similarity_label(left_labels,right_labels)
            
-        output = sess.run([out_node],
+        output = tracer.run(sess, [out_node],
             feed_dict={
                 left_nodes_node: left_nodes,
                 left_children_node: left_children,
+                network.node_counts(left_nodes_node): left_counts,
                 right_nodes_node: right_nodes,
                 right_children_node: right_children,
+                network.node_counts(right_nodes_node): right_counts,
                 labels_node: sim_labels
             }
         )
+        tracer.end_step()
         correct = np.argmax(sim_labels[0])
         predicted = np.argmax(output[0])
         check = (correct == predicted) and True or False
@@ -146,6 +159,7 @@ def test_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS):
     print('Accuracy:', accuracy_score(correct_labels, predictions))
     print(classification_report(correct_labels, predictions, target_names=target_names))
     print(confusion_matrix(correct_labels, predictions))
+    tracer.write()
 
    
 def main():
@@ -155,7 +169,17 @@ def main():
         # argv[2] = ./sample_pickle_data/all_training_pairs.pkl
         # argv[3] = ./sample_pickle_data/python_pretrained_vectors.pkl
         # argv[4] = ./sample_pickle_data/fast_pretrained_vectors.pkl
-    test_model(sys.argv[1],sys.argv[2],sys.argv[3], sys.argv[4])
+    parser = argparse.ArgumentParser()
+    parser.add_argument('logdir')
+    parser.add_argument('inputs', help='testing pairs pickle')
+    parser.add_argument('left_embeddings')
+    parser.add_argument('right_embeddings')
+    tracing.add_arguments(parser)
+    runtime_config.add_arguments(parser)
+    args = parser.parse_args()
+    runtime_config.apply(args)
+    test_model(args.logdir, args.inputs, args.left_embeddings, args.right_embeddings,
+               tracer=tracing.from_args(args))
 
 
 
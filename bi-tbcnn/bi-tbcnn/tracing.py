@@ -0,0 +1,152 @@
+"""Trace where the time of a training or test step goes.
+
+For sampled steps, the session runs with full tracing and the per-op timings
+of its RunMetadata are collected, together with Python-side spans (sampling
+trees, padding batches, the session run itself) timed on the same clock. The
+difference between a session run span and its ops is the time spent
+converting the feed dict and fetching the results.
+
+At the end, write() produces:
+
+- a Chrome trace (open in chrome://tracing or https://ui.perfetto.dev) with
+  the ops of every device and thread next to the Python spans,
+- a table of op types and Python spans sorted by total time, printed and
+  written next to the trace with a .txt extension.
+
+Steps are traced per phase (e.g. train and test), each with its own budget
+of traced steps and its own rows in the table."""
+
+import os
+import json
+import time
+from collections import defaultdict
+from contextlib import contextmanager
+import tensorflow as tf
+
+PYTHON_PID = 0
+
+
+def add_arguments(parser):
+    """Add the tracing flags to a script's argument parser."""
+    group = parser.add_argument_group('tracing')
+    group.add_argument('--trace', default=None, metavar='FILE',
+                       help='write a Chrome trace of sampled steps to FILE')
+    group.add_argument('--trace-every', type=int, default=100,
+                       help='trace one step out of this many')
+    group.add_argument('--trace-steps', type=int, default=10,
+                       help='stop tracing after this many steps')
+
+
+def from_args(args):
+    return Tracer(args.trace, args.trace_every, args.trace_steps)
+
+
+class Tracer(object):
+    """Collects traces of sampled steps. With outfile None every method is a
+    no-op, so scripts can call it unconditionally."""
+
+    def __init__(self, outfile=None, every=100, max_steps=10):
+        self.outfile = outfile
+        self.every = every
+        self.max_steps = max_steps
+        # phase -> number of traced steps
+        self.traced_steps = defaultdict(int)
+        self.phase = None
+        self.active = False
+        self.options = None
+        self.events = []
+        self.devices = {}
+        # (phase, name) -> [total microseconds, count], for the summary table
+        self.op_times = defaultdict(lambda: [0, 0])
+        self.span_times = defaultdict(lambda: [0, 0])
+
+    def begin_step(self, step, phase='train'):
+        """Start tracing step if it is sampled."""
+        self.phase = phase
+        self.active = (self.outfile is not None and self.traced_steps[phase] < self.max_steps
+                       and step % self.every == 0)
+        if self.active:
+            self.options = tf.RunOptions(trace_level=tf.RunOptions.FULL_TRACE)
+
+    def end_step(self):
+        if self.active:
+            self.traced_steps[self.phase] += 1
+        self.active = False
+        self.options = None
+
+    def run(self, sess, fetches, feed_dict=None, name='session run'):
+        """sess.run, with its ops collected if the current step is traced."""
+        if not self.active:
+            return sess.run(fetches, feed_dict=feed_dict)
+        run_metadata = tf.RunMetadata()
+        with self.span(name):
+            result = sess.run(fetches, feed_dict=feed_dict, options=self.options,
+                              run_metadata=run_metadata)
+        self._add_step_stats(run_metadata.step_stats)
+        return result
+
+    @contextmanager
+    def span(self, name):
+        """Time a block of Python code of a traced step."""
+        if not self.active:
+            yield
+            return
+        start = time.time()
+        try:
+            yield
+        finally:
+            end = time.time()
+            duration = int((end - start) * 1e6)
+            self.events.append({
+                'name': name, 'cat': 'python', 'ph': 'X', 'pid': PYTHON_PID, 'tid': 0,
+                'ts': int(start * 1e6), 'dur': duration, 'args': {'phase': self.phase},
+            })
+            self.span_times[self.phase, name][0] += duration
+            self.span_times[self.phase, name][1] += 1
+
+    def _add_step_stats(self, step_stats):
+        for dev_stats in step_stats.dev_stats:
+            if dev_stats.device not in self.devices:
+                self.devices[dev_stats.device] = len(self.devices) + 1
+            pid = self.devices[dev_stats.device]
+            for node_stats in dev_stats.node_stats:
+                # timeline labels read "node = OpType(inputs)"
+                label = node_stats.timeline_label
+                op = label.split(' = ', 1)[1].split('(', 1)[0] if ' = ' in label else node_stats.node_name
+                duration = node_stats.all_end_rel_micros
+                self.events.append({
+                    'name': op, 'cat': 'op', 'ph': 'X', 'pid': pid, 'tid': node_stats.thread_id,
+                    'ts': node_stats.all_start_micros, 'dur': duration,
+                    'args': {'name': node_stats.node_name, 'phase': self.phase},
+                })
+                self.op_times[self.phase, op][0] += duration
+                self.op_times[self.phase, op][1] += 1
+
+    def summary(self):
+        """Rows of (phase, kind, name, total ms, count, mean ms) sorted by
+        phase and total time."""
+        rows = [(phase, 'op', name, total / 1000.0, count, total / 1000.0 / count)
+                for (phase, name), (total, count) in self.op_times.items()]
+        rows += [(phase, 'python', name, total / 1000.0, count, total / 1000.0 / count)
+                 for (phase, name), (total, count) in self.span_times.items()]
+        return sorted(rows, key=lambda row: (row[0], -row[3]))
+
+    def write(self):
+        """Write the Chrome trace and the summary table, if anything was traced."""
+        if self.outfile is None or not sum(self.traced_steps.values()):
+            return
+        names = [{'name': 'process_name', 'ph': 'M', 'pid': PYTHON_PID, 'args': {'name': 'python'}}]
+        names += [{'name': 'process_name', 'ph': 'M', 'pid': pid, 'args': {'name': device}}
+                  for device, pid in self.devices.items()]
+        with open(self.outfile, 'w') as fh:
+            json.dump({'traceEvents': names + self.events}, fh)
+
+        lines = ['Traced steps: ' + ', '.join(
+                     '%s %d' % (phase, n) for phase, n in sorted(self.traced_steps.items())),
+                 '%-8s %-8s %-40s %12s %8s %10s' % ('phase', 'kind', 'name', 'total ms', 'count', 'mean ms')]
+        lines += ['%-8s %-8s %-40s %12.3f %8d %10.3f' % row for row in self.summary()]
+        table = '\n'.join(lines)
+        print(table)
+        with open(os.path.splitext(self.outfile)[0] + '.txt', 'w') as fh:
+            fh.write(table + '\n')
+        print('Trace written to ' + self.outfile)
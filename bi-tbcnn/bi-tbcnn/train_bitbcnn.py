@@ -1,12 +1,22 @@
 # This file is just another version to test with 2 different AST tree on each side of the Bi-TBCNN
 import os
+import time
 import logging
 import pickle
 import tensorflow as tf
 import numpy as np
 import network as network
 import sampling as sampling
-from parameters import LEARN_RATE, EPOCHS, CHECKPOINT_EVERY, BATCH_SIZE, DROP_OUT
+import inference as inference
+import parallel as parallel
+import async_checkpoint as async_checkpoint
+import tracing as tracing
+import runtime_config as runtime_config
+import metrics as metrics
+import curriculum as curriculum
+import warm_start as warm_start
+import early_stopping as early_stopping
+from parameters import LEARN_RATE, EPOCHS, BATCH_SIZE, DROP_OUT, INFERENCE_BATCH_SIZE
 from sklearn.metrics import classification_report, confusion_matrix, accuracy_score
 import random
 import sys
@@ -32,9 +42,9 @@ def get_one_hot_similarity_label(left_labels, right_labels):
     return sim_labels, sim_labels_num
 
 
-def get_trees_from_pairs(label_1_pairs,labeL_0_pairs):
+def get_trees_from_pairs(label_1_pairs,labeL_0_pairs,rng=random):
     all_pairs = label_1_pairs + labeL_0_pairs
-    random.shuffle(all_pairs)
+    rng.shuffle(all_pairs)
     left_trees = []
     right_trees = []
     for pair in all_pairs:
@@ -42,13 +52,80 @@ def get_trees_from_pairs(label_1_pairs,labeL_0_pairs):
         right_trees.append(pair[1])
     return left_trees, right_trees
 
+def epoch_rng(seed, rank, epoch):
+    """The random generator sampling the pairs of one epoch, derived from the
+    seed so that a resumed run samples the same pairs."""
+    return random.Random((seed * 100003 + rank) * 100003 + epoch)
+
+
+def drop_out_layer(node, size, masks):
+    """Drop out with a mask fed for every step, see sample_drop_out_masks.
+    Unlike tf.layers.dropout, the masks don't depend on the state of the
+    session, so a resumed or repeated run drops the same units."""
+    mask = tf.placeholder(tf.float32, [None, size])
+    masks.append((mask, size))
+    return node * mask
+
+
+def sample_drop_out_masks(masks, batch_size, seed, rank, step, micro_batch=0):
+    """Feed dict entries for the drop out masks of one micro-batch of a step."""
+    rng = np.random.RandomState([seed, rank, step % (2 ** 32), micro_batch])
+    return {
+        mask: (rng.uniform(size=(batch_size, size)) >= DROP_OUT) / (1.0 - DROP_OUT)
+        for mask, size in masks
+    }
+
+
 def generate_random_batch(iterable,size):
     l = len(iterable)
     for ndx in range(0, l, n):
         yield iterable[ndx:min(ndx + n, l)]
 
 
-def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS, with_drop_out=1,device="-1"):
+def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS, with_drop_out=1,device="-1", comm=None,
+                checkpoint_options=None, seed=None, effective_batch_size=BATCH_SIZE, micro_batch_nodes=None,
+                tracer=None, metrics_options=None, curriculum_options=None, eval_pairs=None, eval_every=0,
+                left_init=None, right_init=None, freeze_towers=0, objective='pairs',
+                stopping_options=None, label_file=None):
+    """Train the Bi-TBCNN. All randomness derives from seed, which is stored
+    with the checkpoints along with the epoch and the position in it, so a
+    restarted run continues exactly where it stopped. Without a seed a random
+    one is picked.
+
+    Every optimizer step is taken on effective_batch_size pairs, whose
+    gradients are accumulated over micro-batches of at most BATCH_SIZE pairs
+    and micro_batch_nodes padded nodes, see sampling.micro_batches.
+
+    Sampled steps are traced by tracer, see tracing.Tracer, and
+    metrics_options are passed to metrics.MetricsLogger.
+
+    curriculum_options are passed to curriculum.Curriculum, which picks the
+    pairs of every epoch. With eval_every, the accuracy on the pairs pickle
+    eval_pairs is measured every eval_every epochs to report when the final
+    accuracy was reached.
+
+    A new model starts with the towers of the TBCNN checkpoints in left_init
+    and right_init if given, and only trains its hidden layers for the first
+    freeze_towers epochs, see warm_start.py.
+
+    With objective 'pairs', every step trains on effective_batch_size pairs,
+    half of the same algorithm and half of different ones. With 'all-pairs'
+    or 'infonce' (see network.pairwise_loss_layer), a step encodes the left
+    and right trees of effective_batch_size pairs of the same algorithm and
+    trains on every left tree against every right tree, the square of the
+    pairs for the same tree encodings.
+
+    stopping_options are passed to early_stopping.EarlyStopping; with a
+    validation fraction, that fraction of the training pairs is held out and
+    evaluated on instead of eval_pairs.
+
+    label_file lists the algorithm labels of both sides, one per line (see
+    inference.read_label_file), instead of the ten of the paper."""
+    in_batch = objective != 'pairs'
+    if in_batch and micro_batch_nodes is not None:
+        raise ValueError('The ' + objective + ' objective needs whole batches, without --micro-batch-nodes')
+    if tracer is None:
+        tracer = tracing.Tracer()
     os.environ['CUDA_VISIBLE_DEVICES'] = device
     
     print("Using device : " + device)
@@ -58,6 +135,9 @@ def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS,
     n_classess = 2
     left_algo_labels = ["bfs","bubblesort","knapsack","linkedlist","mergesort","quicksort","heap","dfs","stack","queue"]
     right_algo_labels = ["bfs","bubblesort","knapsack","linkedlist","mergesort","quicksort","heap","dfs","stack","queue"]
+    if label_file is not None:
+        left_algo_labels = right_algo_labels = inference.read_label_file(label_file)
+        print(str(len(left_algo_labels)) + ' labels of ' + label_file)
 
     # left_algo_labels = ["bfs","bubblesort","knapsack","linkedlist","mergesort","quicksort"]
     # right_algo_labels = ["bfs","bubblesort","knapsack","linkedlist","mergesort","quicksort"]
@@ -71,6 +151,17 @@ def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS,
     # print "Using device : " + device
     with open(inputs, "rb") as fh:
         all_1_pairs, all_0_pairs = pickle.load(fh)
+    stopping_options = stopping_options or {}
+    all_1_pairs, validation_1_pairs = early_stopping.split_validation(all_1_pairs, stopping_options.get('validation'))
+    all_0_pairs, validation_0_pairs = early_stopping.split_validation(all_0_pairs, stopping_options.get('validation'))
+    if stopping_options.get('patience') and not stopping_options.get('validation') and eval_pairs is None:
+        raise ValueError('Early stopping needs held-out pairs, from --validation or --eval-pairs')
+    if stopping_options.get('patience') and not eval_every:
+        eval_every = 1
+    all_1_pairs = parallel.shard(all_1_pairs, comm)
+    all_0_pairs = parallel.shard(all_0_pairs, comm)
+    # every worker samples its part of the pairs of an epoch
+    pairs_per_epoch = 1000 // (1 if comm is None else comm.world_size)
 
     # print "Shuffling training data"
     # random.shuffle(all_1_pairs)
@@ -85,37 +176,67 @@ def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS,
 
     num_feats = len(left_embeddings[0])
 
+    state = async_checkpoint.load_state(logdir)
+    if state is not None:
+        seed = state['seed']
+    elif seed is None:
+        # below 2 ** 24 so that it survives the float32 broadcast
+        seed = random.SystemRandom().randint(0, 2 ** 24 - 1)
+        if comm is not None:
+            seed = int(comm.broadcast([np.array([seed], dtype=np.float32)])[0][0])
+    rank = 0 if comm is None else comm.rank
+    print("Seed : " + str(seed))
+    tf.set_random_seed(seed)
+
     # build the inputs and outputs of the network
-    left_nodes_node, left_children_node, left_pooling_node = network.init_net_for_siamese(
-        num_feats
+    (left_nodes_node, left_children_node, left_pooling_node), left_tower_variables = warm_start.new_variables(
+        lambda: network.init_net_for_siamese(num_feats)
     )
 
-    right_nodes_node, right_children_node, right_pooling_node = network.init_net_for_siamese(
-        num_feats
+    (right_nodes_node, right_children_node, right_pooling_node), right_tower_variables = warm_start.new_variables(
+        lambda: network.init_net_for_siamese(num_feats)
     )
-    # with tf.device(device):
-    merge_node = tf.concat([left_pooling_node, right_pooling_node], -1)
-
-    hidden_node = network.hidden_layer(merge_node, 200, 200)
+    drop_out_masks = []
+    if in_batch:
+        hidden_node = network.pairwise_hidden_layer(left_pooling_node, right_pooling_node, 200, 200)
+    else:
+        # with tf.device(device):
+        merge_node = tf.concat([left_pooling_node, right_pooling_node], -1)
+        hidden_node = network.hidden_layer(merge_node, 200, 200)
     if int(with_drop_out) == 1:
-        hidden_node = tf.layers.dropout(hidden_node, rate=DROP_OUT, training=True)
+        hidden_node = drop_out_layer(hidden_node, 200, drop_out_masks)
 
     hidden_node = network.hidden_layer(hidden_node, 200, 200)
 
     if int(with_drop_out) == 1:
-        hidden_node = tf.layers.dropout(hidden_node, rate=DROP_OUT, training=True)
+        hidden_node = drop_out_layer(hidden_node, 200, drop_out_masks)
 
     hidden_node = network.hidden_layer(hidden_node, 200, n_classess)
 
     if int(with_drop_out) == 1:
-        hidden_node = tf.layers.dropout(hidden_node, rate=DROP_OUT, training=True)
+        hidden_node = drop_out_layer(hidden_node, n_classess, drop_out_masks)
 
     out_node = network.out_layer(hidden_node)
 
-    labels_node, loss_node = network.loss_layer(hidden_node, n_classess)
+    if in_batch:
+        left_ids_node, right_ids_node, loss_node = network.pairwise_loss_layer(hidden_node, objective)
+        label_ids = {label: i for i, label in enumerate(left_algo_labels)}
+    else:
+        labels_node, loss_node = network.loss_layer(hidden_node, n_classess)
 
     optimizer = tf.train.AdamOptimizer(LEARN_RATE)
-    train_step = optimizer.minimize(loss_node)
+    accumulating = not in_batch and (effective_batch_size > BATCH_SIZE or micro_batch_nodes is not None)
+    # while the towers are frozen, the head steps only train the hidden layers
+    towers = set(left_tower_variables + right_tower_variables)
+    head_variables = [var for var in tf.trainable_variables() if var not in towers]
+    if comm is None and not accumulating:
+        train_step = optimizer.minimize(loss_node)
+        head_train_step = optimizer.minimize(loss_node, var_list=head_variables) if freeze_towers else None
+        gradient_step = head_gradient_step = None
+    else:
+        gradient_step = parallel.GradientStep(optimizer, loss_node)
+        head_gradient_step = parallel.GradientStep(optimizer, loss_node, head_variables) if freeze_towers else None
+        train_step = head_train_step = None
 
     # tf.summary.scalar('loss', loss_node)
 
@@ -136,7 +257,7 @@ def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS,
     config.gpu_options.per_process_gpu_memory_fraction = 0.98
 
 
-    sess = tf.Session(config = config)
+    sess = tf.Session(config = parallel.session_config(comm, config))
 
     # sess = tf.Session()
     sess.run(tf.global_variables_initializer())
@@ -144,16 +265,51 @@ def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS,
     with tf.name_scope('saver'):
         saver = tf.train.Saver()
         summaries = tf.summary.merge_all()
-        writer = tf.summary.FileWriter(logdir, sess.graph)
+        if parallel.is_chief(comm):
+            writer = tf.summary.FileWriter(logdir, sess.graph)
         ckpt = tf.train.get_checkpoint_state(logdir)
         if ckpt and ckpt.model_checkpoint_path:
             print("Continue training with old model")
             saver.restore(sess, ckpt.model_checkpoint_path)
+        else:
+            if left_init is not None:
+                warm_start.load_tower(sess, left_tower_variables, left_init)
+            if right_init is not None:
+                warm_start.load_tower(sess, right_tower_variables, right_init)
         # else:
         #     raise 'Checkpoint not found.'
+    if comm is not None:
+        parallel.broadcast_variables(sess, comm)
 
     checkfile = os.path.join(logdir, 'cnn_tree.ckpt')
+    if parallel.is_chief(comm):
+        checkpointer = async_checkpoint.AsyncCheckpointer(sess, checkfile, **(checkpoint_options or {}))
+        metrics_logger = metrics.MetricsLogger(
+            unit='pairs', writer=writer, workers=1 if comm is None else comm.world_size,
+            **(metrics_options or {}))
+        timeline = metrics.AccuracyTimeline((metrics_options or {}).get('outfile'))
+        stopper = early_stopping.EarlyStopping(sess, logdir, **dict(stopping_options,
+                                               **((state or {}).get('early_stopping') or {})))
+    validating = bool(validation_1_pairs or validation_0_pairs)
+    evaluating = eval_every and (validating or eval_pairs is not None)
+    if evaluating and validating:
+        eval_left_trees, eval_right_trees = get_trees_from_pairs(validation_1_pairs, validation_0_pairs)
+    elif evaluating:
+        with open(eval_pairs, 'rb') as fh:
+            eval_left_trees, eval_right_trees = get_trees_from_pairs(pickle.load(fh), [])
+    schedule = curriculum.Curriculum(**dict(curriculum_options or {}, fraction=state and state.get('curriculum')))
     steps = 0   
+    # steps restarts every epoch, checkpoints are numbered by total_steps
+    total_steps = 0
+    first_epoch, cursor, skip = 1, 0, 0
+    # loss summed over the steps of the epoch, for the curriculum
+    resumed_loss = (0.0, 0)
+    if state is not None:
+        first_epoch, cursor, total_steps = state['epoch'], state['cursor'], state['total_steps']
+        # pairs trained on in the epoch, whatever the batch size they were trained with
+        skip = state.get('consumed', cursor * effective_batch_size)
+        resumed_loss = (state.get('epoch_loss', 0.0), state.get('epoch_steps', 0))
+        print("Resuming at epoch " + str(first_epoch) + ", step " + str(cursor) + ", pair " + str(skip))
 
     using_vector_lookup_left = False
     if os.path.isfile("/input/config.json"):
@@ -164,45 +320,183 @@ def train_model(logdir, inputs, left_embedfile, right_embedfile, epochs=EPOCHS,
     print("Begin training....")
 
     # with tf.device(device):
-    for epoch in range(1, epochs+1):
-        sample_1_pairs = random.sample(all_1_pairs,1000)
-        sample_0_pairs = random.sample(all_0_pairs,1000)
-        shuffle_left_trees, shuffle_right_trees = get_trees_from_pairs(sample_1_pairs,sample_0_pairs)
+    for epoch in range(first_epoch, epochs+1):
+        frozen = epoch <= freeze_towers
+        if frozen:
+            print("Towers frozen in epoch", epoch)
+        epoch_train_step = head_train_step if frozen else train_step
+        epoch_gradient_step = head_gradient_step if frozen else gradient_step
+        rng = epoch_rng(seed, rank, epoch)
+        if in_batch:
+            # the different pairs are those within a batch
+            sample_1_pairs = rng.sample(all_1_pairs, min(len(all_1_pairs), 2 * pairs_per_epoch))
+            sample_0_pairs = []
+        else:
+            sample_1_pairs = rng.sample(all_1_pairs,pairs_per_epoch)
+            sample_0_pairs = rng.sample(all_0_pairs,pairs_per_epoch)
+        shuffle_left_trees, shuffle_right_trees = get_trees_from_pairs(sample_1_pairs,sample_0_pairs,rng)
         print("Left left:",len(shuffle_left_trees),"Len right:",len(shuffle_right_trees))
-        for left_gen_batch, right_gen_batch in sampling.batch_random_samples_2_sides(shuffle_left_trees, left_algo_labels, shuffle_right_trees, right_algo_labels, left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup, using_vector_lookup_left, False, BATCH_SIZE):
-            print("----------------------------------------------------")
-            left_nodes, left_children, left_labels_one_hot, left_labels = left_gen_batch
-
-            right_nodes, right_children, right_labels_one_hot, right_labels = right_gen_batch
-
-            sim_labels, sim_labels_num = get_one_hot_similarity_label(left_labels,right_labels)
-            print(sim_labels)
-
-                
-            _, err, out, merge, labs, left_pooling = sess.run(
-                [train_step, loss_node, out_node, merge_node, labels_node, left_pooling_node],
-                feed_dict={
+        sizes = [(sampling.tree_size(left['tree']), sampling.tree_size(right['tree']))
+                 for left, right in zip(shuffle_left_trees, shuffle_right_trees)]
+        selected = schedule.select(sizes, epoch)
+        if schedule.schedule is not None:
+            print("Curriculum:", len(selected), "pairs of at most", max(sum(sizes[i]) for i in selected), "nodes")
+        # skip the batches trained on before a restart
+        steps, cursor = cursor, 0
+        consumed, skip = skip, 0
+        selected = selected[consumed:]
+        shuffle_left_trees = [shuffle_left_trees[i] for i in selected]
+        shuffle_right_trees = [shuffle_right_trees[i] for i in selected]
+        sizes = [sizes[i] for i in selected]
+        (epoch_loss, epoch_steps), resumed_loss = resumed_loss, (0.0, 0)
+        for groups in sampling.micro_batches(sizes, effective_batch_size, micro_batch_nodes,
+                                             None if in_batch else BATCH_SIZE):
+            step_start = time.time()
+            if parallel.is_chief(comm):
+                logging.debug("----------------------------------------------------")
+            batch_size = float(sum(len(group) for group in groups))
+            tracer.begin_step(total_steps)
+
+            grads, err, pairs = None, 0.0, 0
+            for m, group in enumerate(groups):
+                with tracer.span('sampling'):
+                    left_gen_batch, right_gen_batch = next(sampling.batch_random_samples_2_sides([shuffle_left_trees[j] for j in group], left_algo_labels, [shuffle_right_trees[j] for j in group], right_algo_labels, left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup, using_vector_lookup_left, False, len(group)))
+                left_nodes, left_children, left_labels_one_hot, left_labels, left_counts = left_gen_batch
+
+                right_nodes, right_children, right_labels_one_hot, right_labels, right_counts = right_gen_batch
+
+                feed_dict = {
                     left_nodes_node: left_nodes,
                     left_children_node: left_children,
+                    network.node_counts(left_nodes_node): left_counts,
                     right_nodes_node: right_nodes,
                     right_children_node: right_children,
-                    labels_node: sim_labels
+                    network.node_counts(right_nodes_node): right_counts,
                 }
-            )
+                if in_batch:
+                    feed_dict[left_ids_node] = [label_ids[label] for label in left_labels]
+                    feed_dict[right_ids_node] = [label_ids[label] for label in right_labels]
+                    labs = [int(left == right) for left in left_labels for right in right_labels]
+                else:
+                    sim_labels, sim_labels_num = get_one_hot_similarity_label(left_labels,right_labels)
+                    feed_dict[labels_node] = sim_labels
+                    labs = sim_labels
+                if parallel.is_chief(comm):
+                    logging.debug('%s', labs)
+                pairs += len(labs)
+
+                feed_dict.update(sample_drop_out_masks(drop_out_masks, len(labs), seed, rank, total_steps, m))
+                if epoch_gradient_step is None:
+                    _, micro_err, out = tracer.run(sess,
+                        [epoch_train_step, loss_node, out_node],
+                        feed_dict=feed_dict
+                    )
+                else:
+                    micro_grads, micro_err, out = tracer.run(sess,
+                        [epoch_gradient_step.grads, loss_node, out_node],
+                        feed_dict=feed_dict
+                    )
+                    grads = parallel.accumulate(grads, micro_grads, len(group) / batch_size)
+                err += micro_err * len(group) / batch_size
+
+            if epoch_gradient_step is not None:
+                if comm is not None:
+                    with tracer.span('all-reduce'):
+                        grads = comm.allreduce_mean(grads)
+                with tracer.span('apply gradients'):
+                    epoch_gradient_step.apply(sess, grads)
+            tracer.end_step()
+            epoch_loss += err
+            epoch_steps += 1
 
             # print "hidden : " + str(loss)
-            print('Epoch:', epoch,'Steps:', steps,'Loss:', err, "True Label vs Predicted Label:", zip(labs,out))
+            if parallel.is_chief(comm):
+                print('Epoch:', epoch,'Steps:', steps,'Loss:', err,'Pairs:', pairs)
+                if logging.getLogger().isEnabledFor(logging.DEBUG):
+                    logging.debug('True Label vs Predicted Label: %s', list(zip(labs, out)))
+                metrics_logger.step(total_steps, pairs,
+                                    sum(sizes[j][0] + sizes[j][1] for group in groups for j in group),
+                                    time.time() - step_start)
          
-
-            if steps % CHECKPOINT_EVERY == 0:
-                # save state so we can resume later
-                saver.save(sess, os.path.join(checkfile), steps)
-                print('Checkpoint saved.')
-
-    
             steps+=1
+            total_steps+=1
+            consumed += int(batch_size)
+
+            # save state so we can resume later
+            if parallel.is_chief(comm) and checkpointer.maybe_save(total_steps, {
+                'seed': seed, 'epoch': epoch, 'cursor': steps, 'consumed': consumed, 'total_steps': total_steps,
+                'epoch_loss': epoch_loss, 'epoch_steps': epoch_steps,
+                'curriculum': schedule.state(), 'early_stopping': stopper.state(),
+            }):
+                print('Checkpoint saved.')
         steps = 0
 
+        mean_loss = epoch_loss / max(1, epoch_steps)
+        if schedule.schedule == 'loss' and comm is not None:
+            mean_loss = float(comm.allreduce_mean([np.array([mean_loss])])[0][0])
+        if schedule.end_epoch(mean_loss):
+            print("Curriculum widened to", schedule.fraction, "of the pairs")
+        if evaluating and (epoch % eval_every == 0 or epoch == epochs):
+            stop = False
+            if parallel.is_chief(comm):
+                eval_start = time.time()
+                accuracy = pair_accuracy(sess, eval_left_trees, eval_right_trees, left_algo_labels, right_algo_labels,
+                                         left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup,
+                                         using_vector_lookup_left, left_nodes_node, left_children_node,
+                                         right_nodes_node, right_children_node, out_node, drop_out_masks, in_batch)
+                timeline.add(epoch, accuracy, time.time() - eval_start)
+                print("Epoch:", epoch, "Validation accuracy:" if validating else "Test accuracy:", accuracy)
+                stopper.update(epoch, total_steps, accuracy)
+                stop = stopper.should_stop
+            if early_stopping.agree(comm, stop):
+                print("Stopping early after epoch", epoch)
+                break
+
+    if parallel.is_chief(comm):
+        checkpointer.save(total_steps, {
+            'seed': seed, 'epoch': epochs + 1, 'cursor': 0, 'consumed': 0, 'total_steps': total_steps,
+            'curriculum': schedule.state(), 'early_stopping': stopper.state(),
+        })
+        checkpointer.close()
+        metrics_logger.close(total_steps)
+        timeline.report()
+        stopper.close()
+        stopper.report()
+        tracer.write()
+    if comm is not None:
+        comm.close()
+
+def pair_accuracy(sess, left_trees, right_trees, left_algo_labels, right_algo_labels,
+                  left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup,
+                  using_vector_lookup_left, left_nodes_node, left_children_node,
+                  right_nodes_node, right_children_node, out_node, drop_out_masks, in_batch=False):
+    """Accuracy of the current model on the pairs of left_trees and
+    right_trees, with nothing dropped out. With in_batch, out_node scores
+    all the pairs of a batch and the matching ones are picked. Padded
+    batches pool to the same vectors as single pairs, see
+    network.pooling_layer."""
+    correct, predicted = [], []
+    for left_gen_batch, right_gen_batch in sampling.batch_random_samples_2_sides(left_trees, left_algo_labels, right_trees, right_algo_labels, left_embeddings, left_embed_lookup, right_embeddings, right_embed_lookup, using_vector_lookup_left, False, INFERENCE_BATCH_SIZE):
+        left_nodes, left_children, _, left_labels, left_counts = left_gen_batch
+        right_nodes, right_children, _, right_labels, right_counts = right_gen_batch
+        _, sim_labels_num = get_one_hot_similarity_label(left_labels, right_labels)
+        feed_dict = {
+            left_nodes_node: left_nodes,
+            left_children_node: left_children,
+            network.node_counts(left_nodes_node): left_counts,
+            right_nodes_node: right_nodes,
+            right_children_node: right_children,
+            network.node_counts(right_nodes_node): right_counts,
+        }
+        n = len(left_labels)
+        feed_dict.update({mask: np.ones((n * n if in_batch else n, size)) for mask, size in drop_out_masks})
+        out = sess.run(out_node, feed_dict=feed_dict)
+        if in_batch:
+            out = out.reshape(n, n, -1)[np.arange(n), np.arange(n)]
+        correct.extend(sim_labels_num)
+        predicted.extend(np.argmax(out, axis=1))
+    return accuracy_score(correct, predicted) if correct else 0.0
+
 def main():
         
     # example params : 
@@ -211,7 +505,49 @@ def main():
         # argv[3] = ./sample_pickle_data/python_pretrained_vectors.pkl
         # argv[4] = ./sample_pickle_data/fast_pretrained_vectors.pkl
         # argv[5] = 1
-    train_model(sys.argv[1],sys.argv[2],sys.argv[3], sys.argv[4],EPOCHS, sys.argv[5],sys.argv[6])
+    parser = argparse.ArgumentParser()
+    parser.add_argument('logdir')
+    parser.add_argument('inputs', help='training pairs pickle')
+    parser.add_argument('left_embeddings')
+    parser.add_argument('right_embeddings')
+    parser.add_argument('with_drop_out', help='1 to train with drop out')
+    parser.add_argument('device', help='value of CUDA_VISIBLE_DEVICES')
+    parallel.add_arguments(parser)
+    async_checkpoint.add_arguments(parser)
+    tracing.add_arguments(parser)
+    runtime_config.add_arguments(parser)
+    metrics.add_arguments(parser)
+    curriculum.add_arguments(parser)
+    warm_start.add_arguments(parser)
+    early_stopping.add_arguments(parser)
+    parser.add_argument('--objective', default='pairs', choices=['pairs', 'all-pairs', 'infonce'],
+                        help='train on sampled pairs, or on all the left and right trees of a batch against each other')
+    parser.add_argument('--eval-pairs', default=None,
+                        help='pickle of test pairs, for --eval-every')
+    parser.add_argument('--seed', type=int, default=None,
+                        help='seed of the initialization, sampling and drop out, for reproducible runs')
+    parser.add_argument('--labels', default=None, metavar='FILE',
+                        help='algorithm labels of the pairs, one per line (default: the ten of the paper)')
+    parser.add_argument('--effective-batch-size', type=int, default=BATCH_SIZE,
+                        help='pairs per optimizer step, accumulated over micro-batches')
+    parser.add_argument('--micro-batch-nodes', type=int, default=None,
+                        help='limit on the padded nodes (pairs x largest left and right trees) of a micro-batch')
+    args = parser.parse_args()
+    if args.patience and not args.validation and args.eval_pairs is None:
+        parser.error('--patience needs --validation or --eval-pairs to evaluate on')
+    metrics.configure_logging(args)
+    runtime_config.apply(args)
+
+    status = parallel.launch_workers(args)
+    if status is not None:
+        sys.exit(status)
+
+    train_model(args.logdir, args.inputs, args.left_embeddings, args.right_embeddings, EPOCHS,
+                args.with_drop_out, args.device, parallel.connect(args), async_checkpoint.options(args),
+                args.seed, args.effective_batch_size, args.micro_batch_nodes, tracing.from_args(args),
+                metrics.options(args), curriculum.options(args), args.eval_pairs, args.eval_every,
+                objective=args.objective, stopping_options=early_stopping.options(args), label_file=args.labels,
+                **warm_start.options(args))
     
 
 
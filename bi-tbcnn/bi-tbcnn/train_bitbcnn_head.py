@@ -0,0 +1,190 @@
+"""Fine-tune the hidden layers of a Bi-TBCNN on cached tree vectors.
+
+The towers of a trained Bi-TBCNN are kept frozen: every tree of the pairs is
+encoded once into its pooled vector, and the hidden layers are trained on
+pairs of these vectors, which costs a few matrix products per batch instead
+of a tree convolution per tree. The result is a normal checkpoint, which
+inference.py, test_bitbcnn.py and train_bitbcnn.py can load."""
+
+import os
+import time
+import random
+import pickle
+import hashlib
+import argparse
+import numpy as np
+import tensorflow as tf
+import network as network
+import inference as inference
+import async_checkpoint as async_checkpoint
+import runtime_config as runtime_config
+from parameters import LEARN_RATE, DROP_OUT, INFERENCE_BATCH_SIZE
+
+
+def unique_trees(pairs, side):
+    """The distinct trees of one side of the pairs, and the index of the tree
+    of every pair among them. Pairs made from the same trees share the tree
+    objects, also after pickling."""
+    trees, index, pair_index = [], {}, []
+    for pair in pairs:
+        tree = pair[side]
+        if id(tree) not in index:
+            index[id(tree)] = len(trees)
+            trees.append(tree)
+        pair_index.append(index[id(tree)])
+    return trees, np.array(pair_index, dtype=np.int64)
+
+
+def towers_digest(sess, variables):
+    """Identifies the weights of the towers, to know when a cache is stale."""
+    digest = hashlib.sha1()
+    for value in sess.run(variables):
+        digest.update(np.ascontiguousarray(value).tobytes())
+    return digest.hexdigest()
+
+
+def pairs_digest(pairs_file):
+    """Identifies the pairs pickle by its path, size and modification time."""
+    stat = os.stat(pairs_file)
+    return hashlib.sha1(repr((os.path.abspath(pairs_file), stat.st_size, stat.st_mtime)).encode('utf-8')).hexdigest()
+
+
+def step_rng(seed, step):
+    """The random generator sampling the pairs of one step, derived from the
+    seed as in train_bitbcnn.py, so that a resumed run samples the batches
+    it would have sampled."""
+    return np.random.RandomState([seed, step % (2 ** 32)])
+
+
+def encode_pairs(sess, model, pairs_file, left_embeddings, right_embeddings, cachefile, batch_size):
+    """Return the left and right vectors of the pairs of pairs_file and the
+    indices of the vectors of every same (ones) and different (zeros) pair,
+    from cachefile if it was written with the same towers and pairs."""
+    digest = towers_digest(sess, model['towers']) + pairs_digest(pairs_file)
+    if cachefile is not None and os.path.isfile(cachefile):
+        cache = np.load(cachefile)
+        if str(cache['digest']) == digest:
+            print('Using the vectors cached in ' + cachefile)
+            return cache['left'], cache['right'], cache['ones'], cache['zeros']
+
+    with open(pairs_file, 'rb') as fh:
+        all_1_pairs, all_0_pairs = pickle.load(fh)
+    pairs = all_1_pairs + all_0_pairs
+    left_trees, left_index = unique_trees(pairs, 0)
+    right_trees, right_index = unique_trees(pairs, 1)
+    print('Encoding ' + str(len(left_trees)) + ' left and ' + str(len(right_trees)) + ' right trees...')
+    left, = inference.encode_batches(sess, [model['left_pooling']], model['left_nodes'], model['left_children'],
+                                     [t['tree'] for t in left_trees], left_embeddings, batch_size)
+    right, = inference.encode_batches(sess, [model['right_pooling']], model['right_nodes'], model['right_children'],
+                                      [t['tree'] for t in right_trees], right_embeddings, batch_size)
+    indices = np.stack([left_index, right_index], axis=1)
+    ones, zeros = indices[:len(all_1_pairs)], indices[len(all_1_pairs):]
+    if cachefile is not None:
+        with open(cachefile, 'wb') as fh:
+            np.savez(fh, digest=digest, left=left, right=right, ones=ones, zeros=zeros)
+    return left, right, ones, zeros
+
+
+def build_model(num_feats, drop_out):
+    """The Bi-TBCNN of train_bitbcnn.py, with a train op for its hidden
+    layers only."""
+    (left_nodes, left_children, left_pooling,
+     right_nodes, right_children, right_pooling, hidden) = network.init_net_bitbcnn(
+         num_feats, 2, DROP_OUT if drop_out else None)
+    labels, loss = network.loss_layer(hidden, 2)
+    head = [var for var in tf.trainable_variables() if var.op.name.startswith('hidden')]
+    towers = [var for var in tf.trainable_variables() if not var.op.name.startswith('hidden')]
+
+    optimizer = tf.train.AdamOptimizer(LEARN_RATE)
+    # never run, creates the optimizer slots of the towers as train_bitbcnn.py
+    # does, so that it can continue training from the checkpoint
+    optimizer.minimize(loss)
+    train_step = optimizer.minimize(loss, var_list=head)
+    return {
+        'left_nodes': left_nodes, 'left_children': left_children, 'left_pooling': left_pooling,
+        'right_nodes': right_nodes, 'right_children': right_children, 'right_pooling': right_pooling,
+        'labels': labels, 'loss': loss, 'train_step': train_step, 'towers': towers,
+    }
+
+
+def train_head(logdir, pairs_file, left_embedfile, right_embedfile, outdir, steps, batch_size,
+               drop_out=True, cachefile=None, seed=None, report_every=1000, checkpoint_options=None):
+    """Train the hidden layers of the Bi-TBCNN of logdir for steps batches of
+    batch_size pairs, half of them same and half different pairs, and write
+    the model to outdir. Continues from the checkpoint of outdir if any."""
+    with open(left_embedfile, 'rb') as fh:
+        left_embeddings, _ = pickle.load(fh)
+    with open(right_embedfile, 'rb') as fh:
+        right_embeddings, _ = pickle.load(fh)
+
+    model = build_model(len(left_embeddings[0]), drop_out)
+    sess = tf.Session(config=runtime_config.session_config())
+    sess.run(tf.global_variables_initializer())
+    state = async_checkpoint.load_state(outdir)
+    if tf.train.get_checkpoint_state(outdir):
+        print('Continue training with ' + outdir)
+        inference.restore(sess, outdir)
+    else:
+        inference.restore(sess, logdir)
+
+    left, right, ones, zeros = encode_pairs(sess, model, pairs_file, left_embeddings, right_embeddings,
+                                            cachefile, INFERENCE_BATCH_SIZE)
+    print(str(len(ones)) + ' same and ' + str(len(zeros)) + ' different pairs')
+    sim_labels = np.array([[0.0, 1.0]] * (batch_size // 2) + [[1.0, 0.0]] * (batch_size - batch_size // 2))
+
+    first_step = state['step'] if state else 0
+    if state and state.get('seed') is not None:
+        seed = state['seed']
+    elif seed is None:
+        seed = random.SystemRandom().randint(0, 2 ** 24 - 1)
+    print('Seed : ' + str(seed))
+    checkpointer = async_checkpoint.AsyncCheckpointer(sess, os.path.join(outdir, 'cnn_tree.ckpt'),
+                                                      **(checkpoint_options or {}))
+    start, loss_sum = time.time(), 0.0
+    for step in range(first_step + 1, steps + 1):
+        rng = step_rng(seed, step)
+        batch = np.concatenate([ones[rng.randint(len(ones), size=batch_size // 2)],
+                                zeros[rng.randint(len(zeros), size=batch_size - batch_size // 2)]])
+        _, err = sess.run([model['train_step'], model['loss']], feed_dict={
+            model['left_pooling']: left[batch[:, 0]],
+            model['right_pooling']: right[batch[:, 1]],
+            model['labels']: sim_labels,
+        })
+        loss_sum += err
+        if step % report_every == 0:
+            elapsed = time.time() - start
+            print('Step:', step, 'Loss:', loss_sum / report_every,
+                  'Pairs/sec:', int(report_every * batch_size / elapsed))
+            start, loss_sum = time.time(), 0.0
+        checkpointer.maybe_save(step, {'step': step, 'seed': seed})
+    checkpointer.save(steps, {'step': steps, 'seed': seed})
+    checkpointer.close()
+    sess.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir', help='directory holding the train_bitbcnn.py checkpoints')
+    parser.add_argument('inputs', help='training pairs pickle')
+    parser.add_argument('left_embeddings')
+    parser.add_argument('right_embeddings')
+    parser.add_argument('outdir', help='directory to write the fine-tuned checkpoints to')
+    parser.add_argument('--steps', type=int, default=100000)
+    parser.add_argument('--batch-size', type=int, default=1024, help='pairs per step')
+    parser.add_argument('--no-drop-out', dest='drop_out', action='store_false')
+    parser.add_argument('--cache', default=None, metavar='FILE',
+                        help='keep the encoded trees in FILE (.npz) for the next run')
+    parser.add_argument('--seed', type=int, default=None)
+    parser.add_argument('--report-every', type=int, default=1000)
+    async_checkpoint.add_arguments(parser)
+    runtime_config.add_arguments(parser)
+    args = parser.parse_args()
+    runtime_config.apply(args)
+
+    train_head(args.logdir, args.inputs, args.left_embeddings, args.right_embeddings, args.outdir,
+               args.steps, args.batch_size, args.drop_out, args.cache, args.seed, args.report_every,
+               async_checkpoint.options(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,221 @@
+"""Train one model for the trees of any number of languages.
+
+Every language brings its trees pickle (fast_pickle_file_to_training_trees.py)
+and its node kind embeddings (ast2vec). All languages share one tree
+convolution and projection, behind an adapter per language, and are encoded
+into the same space of unit vectors (see network.init_net_multilang), so the
+model grows by one adapter per language instead of one model per pair of
+languages.
+
+No pairs are prepared: every step draws two different languages, batch_size
+labels both have training trees of, and one such tree per label in each
+language, and trains with the InfoNCE loss of the similarities of all the
+left and right trees of the step (network.similarity_loss_layer).
+
+With --eval-every, the test trees of every language are encoded once and,
+for every ordered pair of languages, the share of the trees of the first
+whose most similar tree of the second has the same label is reported."""
+
+import os
+import time
+import pickle
+import argparse
+import numpy as np
+import tensorflow as tf
+import network as network
+import sampling as sampling
+import inference as inference
+import async_checkpoint as async_checkpoint
+import runtime_config as runtime_config
+from parameters import LEARN_RATE, BATCH_SIZE, INFERENCE_BATCH_SIZE
+
+
+def load_languages(specs):
+    """The trees and embeddings of every (name, trees pickle, embeddings
+    pickle) of specs, the embeddings padded to the largest of them."""
+    languages = []
+    for name, treesfile, embedfile in specs:
+        with open(treesfile, 'rb') as fh:
+            trees, test_trees, _ = pickle.load(fh)
+        with open(embedfile, 'rb') as fh:
+            embeddings, _ = pickle.load(fh)
+        languages.append({'name': name, 'trees': trees, 'test_trees': test_trees,
+                          'embeddings': embeddings, 'embedfile': embedfile})
+    feature_size = max(len(language['embeddings'][0]) for language in languages)
+    for language in languages:
+        language['embeddings'] = inference.pad_embeddings(language['embeddings'], feature_size)
+        language['by_label'] = {}
+        for tree in language['trees']:
+            language['by_label'].setdefault(tree['label'], []).append(tree)
+    return languages, feature_size
+
+
+def shared_labels(languages):
+    """{(a, b): labels} of every ordered pair of languages with at least two
+    labels in common."""
+    pairs = {}
+    for a, left in enumerate(languages):
+        for b, right in enumerate(languages):
+            shared = sorted(set(left['by_label']) & set(right['by_label']))
+            if a != b and len(shared) >= 2:
+                pairs[(a, b)] = shared
+    if not pairs:
+        raise ValueError('No two languages have two labels in common')
+    return pairs
+
+
+def sample_step(rng, languages, pairs, batch_size):
+    """Two different languages of pairs (see shared_labels) and the trees of
+    a step, as (language index, trees, labels) of each side. The trees of
+    the same label are the positives."""
+    keys = sorted(pairs)
+    a, b = keys[rng.randint(len(keys))]
+    shared = pairs[(a, b)]
+    labels = [shared[i] for i in rng.choice(len(shared), min(batch_size, len(shared)), replace=False)]
+    sides = []
+    for index in (a, b):
+        by_label = languages[index]['by_label']
+        trees = [by_label[label][rng.randint(len(by_label[label]))]['tree'] for label in labels]
+        sides.append((index, trees, labels))
+    return sides
+
+
+def retrieval_accuracy(vectors, labels):
+    """[i][j]: share of the trees of language i whose most similar tree of
+    language j has the same label."""
+    accuracy = np.zeros((len(vectors), len(vectors)))
+    for i in range(len(vectors)):
+        for j in range(len(vectors)):
+            if i == j or not len(vectors[i]) or not len(vectors[j]):
+                continue
+            nearest = np.argmax(np.dot(vectors[i], np.transpose(vectors[j])), axis=1)
+            accuracy[i, j] = np.mean([labels[i][k] == labels[j][n] for k, n in enumerate(nearest)])
+    return accuracy
+
+
+def evaluate(sess, encoder, languages):
+    """Encode the test trees of every language once and print their
+    retrieval accuracy between every pair of languages."""
+    nodes_node, children_node, language_node, vectors_node = encoder
+    vectors, labels = [], []
+    for index, language in enumerate(languages):
+        vectors.append(inference.encode_batches(
+            sess, [vectors_node], nodes_node, children_node, [t['tree'] for t in language['test_trees']],
+            language['embeddings'], INFERENCE_BATCH_SIZE, {language_node: index})[0])
+        labels.append([t['label'] for t in language['test_trees']])
+    accuracy = retrieval_accuracy(vectors, labels)
+    names = [language['name'] for language in languages]
+    width = max(len(name) for name in names)
+    print('Retrieval accuracy (row: query language, column: searched language):')
+    print(' ' * width + ''.join(' %8s' % name[:8] for name in names))
+    for name, row in zip(names, accuracy):
+        print(name.ljust(width) + ''.join(' %8.3f' % value for value in row))
+    mean = accuracy.sum() / max(1, len(names) * (len(names) - 1))
+    print('Mean: %.4f' % mean)
+    return mean
+
+
+def check_resume(logdir, languages, feature_size, adapter_size):
+    """Make sure a model of logdir being continued was trained on the same
+    languages in the same order: the adapter of every language is picked by
+    its position."""
+    if not tf.train.get_checkpoint_state(logdir) or not os.path.isfile(
+            os.path.join(logdir, inference.LANGUAGES_FILE)):
+        return
+    saved = inference.load_languages(logdir)
+    names = [language['name'] for language in saved['languages']]
+    if names != [language['name'] for language in languages]:
+        raise ValueError('The model of %s was trained on the languages %s, give --language in that order'
+                         % (logdir, ', '.join(names)))
+    if (saved['feature_size'], saved['adapter_size']) != (feature_size, adapter_size):
+        raise ValueError('The model of %s has %d features and adapters of %d, not %d and %d'
+                         % (logdir, saved['feature_size'], saved['adapter_size'], feature_size, adapter_size))
+
+
+def train(logdir, specs, steps, batch_size=BATCH_SIZE, temperature=0.1, adapter_size=30, eval_every=0,
+          seed=None, report_every=100, checkpoint_options=None):
+    languages, feature_size = load_languages(specs)
+    print('%d languages: %s' % (len(languages), ', '.join(
+        '%s (%d trees)' % (language['name'], len(language['trees'])) for language in languages)))
+    if not os.path.isdir(logdir):
+        os.makedirs(logdir)
+    check_resume(logdir, languages, feature_size, adapter_size)
+    inference.save_languages(logdir, {
+        'languages': [{'name': language['name'], 'embeddings': language['embedfile']} for language in languages],
+        'feature_size': feature_size,
+        'adapter_size': adapter_size,
+    })
+
+    left, right = network.init_net_multilang(feature_size, len(languages), adapter_size)
+    left_labels_node, right_labels_node, loss_node = network.similarity_loss_layer(left[3], right[3], temperature)
+    train_step = tf.train.AdamOptimizer(LEARN_RATE).minimize(loss_node)
+
+    sess = tf.Session(config=runtime_config.session_config())
+    sess.run(tf.global_variables_initializer())
+    state = async_checkpoint.load_state(logdir)
+    if tf.train.get_checkpoint_state(logdir):
+        print('Continue training with ' + logdir)
+        inference.restore(sess, logdir)
+    first_step = state['step'] if state else 0
+
+    pairs = shared_labels(languages)
+    rng = np.random.RandomState(seed)
+    checkpointer = async_checkpoint.AsyncCheckpointer(sess, os.path.join(logdir, 'cnn_tree.ckpt'),
+                                                      **(checkpoint_options or {}))
+    start, loss_sum = time.time(), 0.0
+    for step in range(first_step + 1, steps + 1):
+        feed_dict = {}
+        for (nodes_node, children_node, language_node, _), labels_node, (index, trees, labels) in zip(
+                [left, right], [left_labels_node, right_labels_node], sample_step(rng, languages, pairs, batch_size)):
+            nodes, children, counts = next(sampling.batch_unlabelled_samples(
+                sampling.gen_unlabelled_samples(trees, languages[index]['embeddings']), len(trees)))
+            feed_dict.update({
+                nodes_node: nodes,
+                children_node: children,
+                network.node_counts(nodes_node): counts,
+                language_node: index,
+                # labels are ids among the labels of the step
+                labels_node: list(range(len(labels))),
+            })
+        _, err = sess.run([train_step, loss_node], feed_dict=feed_dict)
+        loss_sum += err
+        if step % report_every == 0:
+            print('Step:', step, 'Loss:', loss_sum / report_every,
+                  'Steps/sec:', report_every / (time.time() - start))
+            start, loss_sum = time.time(), 0.0
+        checkpointer.maybe_save(step, {'step': step})
+        if eval_every and step % eval_every == 0:
+            evaluate(sess, left, languages)
+    checkpointer.save(steps, {'step': steps})
+    checkpointer.close()
+    if eval_every and steps % eval_every != 0:
+        evaluate(sess, left, languages)
+    sess.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir')
+    parser.add_argument('--language', nargs=3, action='append', required=True,
+                        metavar=('NAME', 'TREES', 'EMBEDDINGS'),
+                        help='a language, its trees pickle and its embeddings pickle; give two or more')
+    parser.add_argument('--steps', type=int, default=10000)
+    parser.add_argument('--batch-size', type=int, default=BATCH_SIZE, help='labels per step')
+    parser.add_argument('--temperature', type=float, default=0.1)
+    parser.add_argument('--adapter-size', type=int, default=30, help='features of the node vectors after the adapters')
+    parser.add_argument('--eval-every', type=int, default=0, metavar='STEPS')
+    parser.add_argument('--seed', type=int, default=None)
+    parser.add_argument('--report-every', type=int, default=100)
+    async_checkpoint.add_arguments(parser)
+    runtime_config.add_arguments(parser)
+    args = parser.parse_args()
+    runtime_config.apply(args)
+    if len(args.language) < 2:
+        parser.error('give two or more --language')
+
+    train(args.logdir, args.language, args.steps, args.batch_size, args.temperature, args.adapter_size,
+          args.eval_every, args.seed, args.report_every, async_checkpoint.options(args))
+
+
+if __name__ == "__main__":
+    main()
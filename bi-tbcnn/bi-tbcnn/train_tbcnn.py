@@ -2,113 +2,284 @@
 https://arxiv.org/pdf/1409.5718.pdf"""
 
 import os
+import time
 import logging
 import pickle
 import tensorflow as tf
 import numpy as np
 import network as network
 import sampling as sampling
+import inference as inference
+import parallel as parallel
+import async_checkpoint as async_checkpoint
+import tracing as tracing
+import runtime_config as runtime_config
+import metrics as metrics
+import curriculum as curriculum
+import folds as folds
+import early_stopping as early_stopping
 import sys
 import random
-from parameters import LEARN_RATE, EPOCHS, CHECKPOINT_EVERY, BATCH_SIZE
+import argparse
+from parameters import LEARN_RATE, EPOCHS, BATCH_SIZE, INFERENCE_BATCH_SIZE
 from sklearn.metrics import classification_report, confusion_matrix, accuracy_score
 
 os.environ['CUDA_VISIBLE_DEVICES'] = "0"
 
 
-def train_model(logdir, infile, embedfile, epochs=EPOCHS, training="True", testing="True"):
-    """Train a classifier to label ASTs"""
+def train_model(logdir, infile, embedfile, epochs=EPOCHS, training="True", testing="True", comm=None,
+                checkpoint_options=None, effective_batch_size=BATCH_SIZE, micro_batch_nodes=None,
+                tracer=None, metrics_options=None, curriculum_options=None, eval_every=0,
+                folds_options=None, stopping_options=None, label_file=None, sampled_labels=0,
+                balanced=False):
+    """Train a classifier to label ASTs. With comm set, this is one worker of
+    data-parallel training, see parallel.py. checkpoint_options are passed
+    to async_checkpoint.AsyncCheckpointer.
+
+    Every optimizer step is taken on effective_batch_size trees, whose
+    gradients are accumulated over micro-batches of at most BATCH_SIZE trees
+    and micro_batch_nodes padded nodes, see sampling.micro_batches.
+    tracer is a tracing.Tracer for the training and testing steps, and
+    metrics_options are passed to metrics.MetricsLogger.
+
+    curriculum_options are passed to curriculum.Curriculum, which picks the
+    trees of every epoch. With eval_every, the test accuracy is measured
+    every eval_every epochs to report when the final accuracy was reached.
+
+    With the manifest of folds_options, the trees of the pickle are split
+    into the training and test trees of one fold, see folds.py, and the test
+    results are written to its results file.
+
+    stopping_options are passed to early_stopping.EarlyStopping; with a
+    validation fraction, the accuracy of eval_every is measured on that
+    fraction of the training trees instead of the test trees. A patience
+    needs that fraction, so that the test trees never pick the model.
+
+    For hundreds of labels: label_file lists the labels to learn, one per
+    line (see inference.read_label_file), and the trees of other labels are
+    dropped. With sampled_labels, the loss of every step is the softmax of
+    the true label against that many sampled labels (network.sampled_loss_layer)
+    instead of all of them. With balanced, the trees of every epoch are drawn
+    so that every label is as frequent."""
+    if tracer is None:
+        tracer = tracing.Tracer()
 
     print("Loading trees...")
     with open(infile, 'rb') as fh:
         trees, test_trees, labels = pickle.load(fh)
+        folds_options = folds_options or {}
+        if folds_options.get('manifest'):
+            trees, test_trees = folds.split(trees, test_trees, folds_options['manifest'],
+                                            folds_options['fold'])
+            print('Fold ' + str(folds_options['fold']) + ': ' + str(len(trees)) + ' training and '
+                  + str(len(test_trees)) + ' test trees')
+        if label_file is not None:
+            labels = inference.read_label_file(label_file)
+            known = set(labels)
+            count = len(trees) + len(test_trees)
+            trees = [tree for tree in trees if tree['label'] in known]
+            test_trees = [tree for tree in test_trees if tree['label'] in known]
+            print(str(len(labels)) + ' labels of ' + label_file + ', dropped '
+                  + str(count - len(trees) - len(test_trees)) + ' trees of other labels')
+        stopping_options = stopping_options or {}
+        if stopping_options.get('patience') and not stopping_options.get('validation'):
+            raise ValueError('Early stopping needs held-out trees, from --validation')
+        trees, validation_trees = early_stopping.split_validation(trees, stopping_options.get('validation'))
+        if stopping_options.get('patience') and not eval_every:
+            eval_every = 1
 
+        trees = parallel.shard(trees, comm)
         random.shuffle(trees)
         
 
     print(labels)
+    if parallel.is_chief(comm):
+        inference.save_labels(logdir, labels)
     print("Loading embeddings....")
     with open(embedfile, 'rb') as fh:
         embeddings, embed_lookup = pickle.load(fh)
         num_feats = len(embeddings[0])
 
     # build the inputs and outputs of the network
-    nodes_node, children_node, hidden_node = network.init_net(
-        num_feats,
-        len(labels)
-    )
+    if sampled_labels:
+        nodes_node, children_node, pooling_node, hidden_node, head = network.init_net_with_head(
+            num_feats,
+            len(labels)
+        )
+        labels_node, loss_node = network.sampled_loss_layer(
+            pooling_node, head, len(labels), min(sampled_labels, len(labels) - 1))
+    else:
+        nodes_node, children_node, hidden_node = network.init_net(
+            num_feats,
+            len(labels)
+        )
+        labels_node, loss_node = network.loss_layer(hidden_node, len(labels))
+    label_index = {label: i for i, label in enumerate(labels)}
 
     out_node = network.out_layer(hidden_node)
-    labels_node, loss_node = network.loss_layer(hidden_node, len(labels))
 
     optimizer = tf.train.AdamOptimizer(LEARN_RATE)
-    train_step = optimizer.minimize(loss_node)
+    accumulating = effective_batch_size > BATCH_SIZE or micro_batch_nodes is not None
+    if comm is None and not accumulating:
+        train_step = optimizer.minimize(loss_node)
+        gradient_step = None
+    else:
+        gradient_step = parallel.GradientStep(optimizer, loss_node)
 
     tf.summary.scalar('loss', loss_node)
 
     ### init the graph
-    sess = tf.Session()#config=tf.ConfigProto(device_count={'GPU':0}))
+    sess = tf.Session(config=parallel.session_config(comm))#config=tf.ConfigProto(device_count={'GPU':0}))
     sess.run(tf.global_variables_initializer())
 
     with tf.name_scope('saver'):
         saver = tf.train.Saver()
         summaries = tf.summary.merge_all()
-        writer = tf.summary.FileWriter(logdir, sess.graph)
+        if parallel.is_chief(comm):
+            writer = tf.summary.FileWriter(logdir, sess.graph)
         ckpt = tf.train.get_checkpoint_state(logdir)
         if ckpt and ckpt.model_checkpoint_path:
             print("Continue training with old model")
             saver.restore(sess, ckpt.model_checkpoint_path)
+    if comm is not None:
+        parallel.broadcast_variables(sess, comm)
 
     checkfile = os.path.join(logdir, 'cnn_tree.ckpt')
 
     if training == "True":
+        if parallel.is_chief(comm):
+            checkpointer = async_checkpoint.AsyncCheckpointer(sess, checkfile, **(checkpoint_options or {}))
+            metrics_logger = metrics.MetricsLogger(
+                unit='trees', writer=writer, workers=1 if comm is None else comm.world_size,
+                **(metrics_options or {}))
+            timeline = metrics.AccuracyTimeline((metrics_options or {}).get('outfile'))
+            stopper = early_stopping.EarlyStopping(sess, logdir, **stopping_options)
+            if stopper.checkpointer is not None:
+                inference.save_labels(stopper.best_dir, labels)
         print("Begin training..........")
-        num_batches = len(trees) // BATCH_SIZE + (1 if len(trees) % BATCH_SIZE != 0 else 0)
+        schedule = curriculum.Curriculum(**(curriculum_options or {}))
+        all_sizes = [sampling.tree_size(tree['tree']) for tree in trees]
+        total_steps = 0
         for epoch in range(1, epochs+1):
-            for i, batch in enumerate(sampling.batch_samples(
-                sampling.gen_samples(trees, labels, embeddings, embed_lookup), BATCH_SIZE
-            )):
-                nodes, children, batch_labels = batch
-                step = (epoch - 1) * num_batches + i * BATCH_SIZE
-
-                if not nodes:
-                    continue # don't try to train on an empty batch
-                # print(batch_labels)
-                _, summary, err, out = sess.run(
-                    [train_step, summaries, loss_node, out_node],
-                    feed_dict={
+            selected = schedule.select(all_sizes, epoch)
+            if balanced:
+                selected = [selected[k] for k in sampling.balanced_indices(
+                    [trees[i]['label'] for i in selected], len(selected))]
+            epoch_trees = [trees[i] for i in selected]
+            sizes = [all_sizes[i] for i in selected]
+            if schedule.schedule is not None:
+                print('Curriculum: ' + str(len(epoch_trees)) + ' trees of at most '
+                      + str(max(sizes)) + ' nodes')
+            epoch_loss, epoch_steps = 0.0, 0
+            for groups in sampling.micro_batches(sizes, effective_batch_size, micro_batch_nodes, BATCH_SIZE):
+                step_start = time.time()
+                step = total_steps
+                total_steps += 1
+                batch_size = float(sum(len(group) for group in groups))
+                tracer.begin_step(step)
+
+                grads, err = None, 0.0
+                for group in groups:
+                    with tracer.span('sampling'):
+                        samples = list(sampling.gen_samples(
+                            [epoch_trees[j] for j in group], labels, embeddings, embed_lookup
+                        ))
+                    with tracer.span('padding'):
+                        nodes, children, batch_labels, counts = next(sampling.batch_samples(samples, len(group)))
+                    if sampled_labels:
+                        batch_labels = [label_index[epoch_trees[j]['label']] for j in group]
+                    # print(batch_labels)
+                    feed_dict = {
                         nodes_node: nodes,
                         children_node: children,
+                        network.node_counts(nodes_node): counts,
                         labels_node: batch_labels
                     }
-                )
+                    if gradient_step is None:
+                        _, summary, micro_err, out = tracer.run(
+                            sess, [train_step, summaries, loss_node, out_node], feed_dict=feed_dict
+                        )
+                    else:
+                        micro_grads, summary, micro_err, out = tracer.run(
+                            sess, [gradient_step.grads, summaries, loss_node, out_node], feed_dict=feed_dict
+                        )
+                        grads = parallel.accumulate(grads, micro_grads, len(group) / batch_size)
+                    err += micro_err * len(group) / batch_size
+
+                if gradient_step is not None:
+                    if comm is not None:
+                        with tracer.span('all-reduce'):
+                            grads = comm.allreduce_mean(grads)
+                    with tracer.span('apply gradients'):
+                        gradient_step.apply(sess, grads)
+                tracer.end_step()
+                epoch_loss += err
+                epoch_steps += 1
 
-                print('Epoch:', epoch, 'Step:', step, 'Loss:', err, 'Max nodes:', len(nodes[0]))
+                if not parallel.is_chief(comm):
+                    continue
+
+                print('Epoch:', epoch, 'Step:', step, 'Loss:', err, 'Max nodes:', len(nodes[0]),
+                      'Micro-batches:', len(groups))
+                metrics_logger.step(step, int(batch_size),
+                                    sum(sizes[j] for group in groups for j in group),
+                                    time.time() - step_start)
 
                 writer.add_summary(summary, step)
-                if step % CHECKPOINT_EVERY == 0:
-                    # save state so we can resume later
-                    saver.save(sess, os.path.join(checkfile), step)
+                # save state so we can resume later
+                if checkpointer.maybe_save(step):
                     print('Checkpoint saved, epoch:' + str(epoch) + ', step: ' + str(step) + ', loss: ' + str(err) + '.')
 
-        saver.save(sess, os.path.join(checkfile), step)
+            mean_loss = epoch_loss / max(1, epoch_steps)
+            if schedule.schedule == 'loss' and comm is not None:
+                mean_loss = float(comm.allreduce_mean([np.array([mean_loss])])[0][0])
+            if schedule.end_epoch(mean_loss):
+                print('Curriculum widened to ' + str(schedule.fraction) + ' of the trees')
+            if eval_every and (epoch % eval_every == 0 or epoch == epochs):
+                stop = False
+                if parallel.is_chief(comm):
+                    eval_start = time.time()
+                    accuracy = test_accuracy(sess, out_node, nodes_node, children_node,
+                                             validation_trees or test_trees, labels, embeddings)
+                    timeline.add(epoch, accuracy, time.time() - eval_start)
+                    print('Epoch:', epoch, 'Validation accuracy:' if validation_trees else 'Test accuracy:', accuracy)
+                    stopper.update(epoch, step, accuracy)
+                    stop = stopper.should_stop
+                if early_stopping.agree(comm, stop):
+                    print('Stopping early after epoch ' + str(epoch))
+                    break
+
+        if parallel.is_chief(comm):
+            checkpointer.save(step)
+            checkpointer.close()
+            metrics_logger.close(step)
+            timeline.report()
+            stopper.close()
+            stopper.report()
+
+    if comm is not None:
+        comm.close()
 
     # compute the training accuracy
-    if testing == "True":
+    if testing == "True" and parallel.is_chief(comm):
         correct_labels = []
         predictions = []
         print('Computing training accuracy...')
-        for batch in sampling.batch_samples(
-            sampling.gen_samples(test_trees, labels, embeddings, embed_lookup), 1
-        ):
-            nodes, children, batch_labels = batch
-            output = sess.run([out_node],
+        for i, test_tree in enumerate(test_trees):
+            tracer.begin_step(i, 'test')
+            with tracer.span('sampling'):
+                samples = list(sampling.gen_samples([test_tree], labels, embeddings, embed_lookup))
+            with tracer.span('padding'):
+                nodes, children, batch_labels, counts = next(sampling.batch_samples(samples, 1))
+            output = tracer.run(sess, [out_node],
                 feed_dict={
                     nodes_node: nodes,
                     children_node: children,
+                    network.node_counts(nodes_node): counts,
                 }
             )
-            print(output)
+            tracer.end_step()
+            logging.debug('%s', output)
             correct_labels.append(np.argmax(batch_labels))
             predictions.append(np.argmax(output))
 
@@ -116,17 +287,70 @@ def train_model(logdir, infile, embedfile, epochs=EPOCHS, training="True", testi
         print('Accuracy:', accuracy_score(correct_labels, predictions))
         print(classification_report(correct_labels, predictions, target_names=target_names))
         print(confusion_matrix(correct_labels, predictions))
+        if folds_options.get('results'):
+            folds.write_results(folds_options['results'], labels, correct_labels, predictions)
+
+    if parallel.is_chief(comm):
+        tracer.write()
+
+
+def test_accuracy(sess, out_node, nodes_node, children_node, test_trees, labels, embeddings):
+    """Accuracy of the current model on test_trees. Its padded batches pool
+    to the same vectors as the one-tree batches of the final test, see
+    network.pooling_layer, so the best checkpoint is chosen on the accuracy
+    that is reported."""
+    if not test_trees:
+        return 0.0
+    out, = inference.encode_batches(sess, [out_node], nodes_node, children_node,
+                                    [tree['tree'] for tree in test_trees], embeddings,
+                                    INFERENCE_BATCH_SIZE)
+    label_index = {label: i for i, label in enumerate(labels)}
+    correct = [label_index[tree['label']] for tree in test_trees]
+    return accuracy_score(correct, np.argmax(out, axis=1))
 
 
 def main():
     # logdir = "bi-tbcnn/bi-tbcnn/logs/20_classes_pku_no_dependency"
-    logdir = sys.argv[1]
-    inputs = sys.argv[2]
-    embeddings = sys.argv[3]
-    training = sys.argv[4]
-    testing = sys.argv[5]
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('logdir')
+    parser.add_argument('inputs', help='trees pickle')
+    parser.add_argument('embeddings')
+    parser.add_argument('training', help='"True" to train')
+    parser.add_argument('testing', help='"True" to compute the test accuracy')
+    parallel.add_arguments(parser)
+    async_checkpoint.add_arguments(parser)
+    tracing.add_arguments(parser)
+    runtime_config.add_arguments(parser)
+    metrics.add_arguments(parser)
+    curriculum.add_arguments(parser)
+    folds.add_arguments(parser)
+    early_stopping.add_arguments(parser)
+    parser.add_argument('--effective-batch-size', type=int, default=BATCH_SIZE,
+                        help='trees per optimizer step, accumulated over micro-batches')
+    parser.add_argument('--micro-batch-nodes', type=int, default=None,
+                        help='limit on the padded nodes (trees x largest tree) of a micro-batch')
+    parser.add_argument('--labels', default=None, metavar='FILE',
+                        help='learn the labels of FILE, one per line, dropping the trees of others')
+    parser.add_argument('--sampled-softmax', type=int, default=0, metavar='N',
+                        help='train against N sampled labels per step instead of all labels')
+    parser.add_argument('--balanced', action='store_true',
+                        help='draw the trees of every epoch so that every label is as frequent')
+    args = parser.parse_args()
+    if args.patience and not args.validation:
+        parser.error('--patience needs --validation to evaluate on')
+    metrics.configure_logging(args)
+    runtime_config.apply(args)
+
+    status = parallel.launch_workers(args)
+    if status is not None:
+        sys.exit(status)
 
-    train_model(logdir,inputs,embeddings,EPOCHS, training, testing) 
+    train_model(args.logdir, args.inputs, args.embeddings, EPOCHS, args.training, args.testing,
+                parallel.connect(args), async_checkpoint.options(args),
+                args.effective_batch_size, args.micro_batch_nodes, tracing.from_args(args),
+                metrics.options(args), curriculum.options(args), args.eval_every,
+                folds.options(args), early_stopping.options(args), args.labels, args.sampled_softmax,
+                args.balanced)
 
 if __name__ == "__main__":
     main()
\ No newline at end of file
@@ -0,0 +1,156 @@
+"""A content-addressed cache of TBCNN results, keyed by a hash of the tree of
+node kinds.
+
+The trees fed to the network only carry `Element.kind`, so whitespace,
+comments and identifier names never reach the hash: two files that differ
+only in those get the same key and are encoded once. The cache stores the
+pooled vector and the class probabilities of every tree in a size-bounded
+directory, evicting the least recently used entries first.
+
+Every key also holds the digest of the classifier: its weights, its
+embeddings and labels. A retrained model or other embeddings miss on the
+entries of the old ones, which age out of the cache."""
+
+import os
+import pickle
+import hashlib
+import tempfile
+from collections import deque, OrderedDict
+import numpy as np
+
+
+def tree_hash(tree):
+    """Hash a {'node', 'children'} tree. The kinds in BFS order together with
+    the number of children of every node identify the tree exactly."""
+    digest = hashlib.sha1()
+    queue = deque([tree])
+    while queue:
+        node = queue.popleft()
+        digest.update((str(node['node']) + ':' + str(len(node['children'])) + ';').encode('ascii'))
+        queue.extend(node['children'])
+    return digest.hexdigest()
+
+
+class TreeCache(object):
+    """A directory of pickled results, one file per tree hash, bounded to
+    max_bytes on disk."""
+
+    def __init__(self, directory, max_bytes):
+        self.directory = directory
+        self.max_bytes = max_bytes
+        self.hits = 0
+        self.misses = 0
+        self.evictions = 0
+        # hash -> size on disk, least recently used first
+        self.entries = OrderedDict()
+        self.total_bytes = 0
+
+        if not os.path.isdir(directory):
+            os.makedirs(directory)
+        found = []
+        for root, _, files in os.walk(directory):
+            for name in files:
+                if name.endswith('.pkl'):
+                    stat = os.stat(os.path.join(root, name))
+                    found.append((stat.st_mtime, name[:-4], stat.st_size))
+        for _, key, size in sorted(found):
+            self.entries[key] = size
+            self.total_bytes += size
+
+    def _path(self, key):
+        return os.path.join(self.directory, key[:2], key + '.pkl')
+
+    def get(self, key):
+        """Return the stored (vector, probabilities), or None."""
+        if key not in self.entries:
+            self.misses += 1
+            return None
+        try:
+            with open(self._path(key), 'rb') as fh:
+                value = pickle.load(fh)
+        except (IOError, OSError, EOFError, pickle.UnpicklingError):
+            # removed or cut short by another process, treat as a miss
+            self.total_bytes -= self.entries.pop(key)
+            self.misses += 1
+            return None
+        self.hits += 1
+        # mark as recently used, also across runs
+        self.entries[key] = self.entries.pop(key)
+        os.utime(self._path(key), None)
+        return value
+
+    def put(self, key, value):
+        if key in self.entries:
+            return
+        path = self._path(key)
+        if not os.path.isdir(os.path.dirname(path)):
+            os.makedirs(os.path.dirname(path))
+        # write to a temporary file and rename, so readers never see a partial entry
+        fd, tmp = tempfile.mkstemp(dir=os.path.dirname(path), suffix='.tmp')
+        with os.fdopen(fd, 'wb') as fh:
+            pickle.dump(value, fh, pickle.HIGHEST_PROTOCOL)
+        os.rename(tmp, path)
+        size = os.path.getsize(path)
+        self.entries[key] = size
+        self.total_bytes += size
+
+        while self.total_bytes > self.max_bytes and len(self.entries) > 1:
+            old_key, old_size = self.entries.popitem(last=False)
+            try:
+                os.remove(self._path(old_key))
+            except OSError:
+                pass
+            self.total_bytes -= old_size
+            self.evictions += 1
+
+    def hit_rate(self):
+        lookups = self.hits + self.misses
+        return float(self.hits) / lookups if lookups else 0.0
+
+    def stats(self):
+        return {
+            'hits': self.hits, 'misses': self.misses, 'hit_rate': round(self.hit_rate(), 4),
+            'evictions': self.evictions, 'entries': len(self.entries), 'bytes': self.total_bytes,
+        }
+
+
+class CachedClassifier(object):
+    """Wraps an inference.TreeClassifier, or a quantization.QuantizedClassifier,
+    so that only trees with an unknown hash are encoded."""
+
+    def __init__(self, classifier, cache):
+        self.classifier = classifier
+        self.cache = cache
+        self.labels = classifier.labels
+        self.model = classifier.digest()
+
+    def key(self, tree):
+        """The cache key of tree under this model."""
+        return hashlib.sha1((self.model + tree_hash(tree)).encode('ascii')).hexdigest()
+
+    def encode(self, trees, batch_size):
+        keys = [self.key(tree) for tree in trees]
+        results = [self.cache.get(key) for key in keys]
+
+        # the same tree may appear more than once in a batch, encode it once
+        missing = OrderedDict()
+        for i, (key, result) in enumerate(zip(keys, results)):
+            if result is None:
+                missing.setdefault(key, i)
+        if missing:
+            vectors, probs = self.classifier.encode([trees[i] for i in missing.values()], batch_size)
+            computed = {}
+            for key, vector, prob in zip(missing.keys(), vectors, probs):
+                computed[key] = (vector, prob)
+                self.cache.put(key, (vector, prob))
+            results = [computed[key] if result is None else result for key, result in zip(keys, results)]
+
+        if not results:
+            return np.zeros((0, 0)), np.zeros((0, len(self.labels)))
+        return np.array([r[0] for r in results]), np.array([r[1] for r in results])
+
+    def predict(self, trees, batch_size):
+        return self.encode(trees, batch_size)[1]
+
+    def close(self):
+        self.classifier.close()
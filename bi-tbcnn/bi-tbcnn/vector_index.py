@@ -0,0 +1,374 @@
+"""An approximate nearest neighbour index over program vectors, to answer
+queries like "which indexed programs are closest to this file?" without
+comparing against every indexed program.
+
+Only vectors of one space can be compared. The two towers of a Bi-TBCNN
+are trained separately, so the vectors of export_vectors.py need one index
+per tower, queried with vectors of that tower. Programs of different
+languages can be compared with the vectors of a train_multilang.py model
+(inference.MultiLanguageEncoder), whose languages share one space.
+
+The index is a Hierarchical Navigable Small World graph (Malkov & Yashunin,
+https://arxiv.org/abs/1603.09320) over cosine distance. Whenever a node is
+expanded, the distances to all of its neighbours are computed with a single
+numpy product, so a query costs a few hundred small matrix-vector products
+whatever the number of indexed programs. Links are numpy id arrays and the
+visited nodes are marked in an array, so that building the index, which
+runs a search per inserted vector, stays in numpy too.
+
+Vectors are read in the `label v1 v2 ...` text format of test_vectors/ (see
+export_vectors.py). The ids returned by queries are line numbers in the file
+the index was built from."""
+
+import sys
+import math
+import time
+import pickle
+import random
+import argparse
+import numpy as np
+
+# a filtered search scans the allowed vectors exactly when there are at most
+# EXACT_FACTOR times ef of them, and otherwise visits at most as many nodes
+# as hold VISIT_FACTOR times ef allowed ones on average
+EXACT_FACTOR = 10
+VISIT_FACTOR = 50
+# candidates expanded together by a search, their neighbours compared with
+# the query in one product
+EXPAND = 16
+
+
+def load_vectors(infile):
+    """Load (labels, vectors) from a `label v1 v2 ...` text file."""
+    labels, vectors = [], []
+    with open(infile, 'r') as fh:
+        for line in fh:
+            parts = line.split()
+            if not parts:
+                continue
+            labels.append(parts[0])
+            vectors.append([float(x) for x in parts[1:]])
+    return labels, np.array(vectors, dtype=np.float32)
+
+
+def _normalize(vectors):
+    norms = np.linalg.norm(vectors, axis=-1, keepdims=True)
+    norms[norms == 0] = 1.0
+    return vectors / norms
+
+
+class HNSWIndex(object):
+    """A HNSW graph over unit-normalised vectors. links[node][level] holds the
+    ids of the neighbours of node in that level of the hierarchy."""
+
+    def __init__(self, dim, M=16, ef_construction=100, seed=0):
+        self.M = M
+        self.M0 = 2 * M
+        self.ef_construction = ef_construction
+        self.level_mult = 1.0 / math.log(M)
+        self.rng = random.Random(seed)
+        self.vectors = np.zeros((0, dim), dtype=np.float32)
+        self.labels = np.array([], dtype=object)
+        self.links = []
+        self.entry = None
+        self.max_level = -1
+        # label -> boolean mask over all vectors, for filtered search
+        self.label_masks = {}
+        # every node visited by a search is marked with a new stamp, so the
+        # nodes visited by the current one are those marked since it started
+        self.marks = np.full(0, -1, dtype=np.int64)
+        self.stamp = 0
+
+    def __len__(self):
+        return len(self.links)
+
+    def _distances(self, query, ids):
+        return 1.0 - self.vectors[ids].dot(query)
+
+    def add(self, vectors, labels):
+        vectors = _normalize(np.asarray(vectors, dtype=np.float32))
+        start = len(self.links)
+        self.vectors = np.concatenate([self.vectors, vectors], axis=0)
+        self.labels = np.concatenate([self.labels, np.array(labels, dtype=object)])
+        self.label_masks = {}
+        self.marks = np.concatenate([self.marks, np.full(len(vectors), -1, dtype=np.int64)])
+        for node in range(start, start + len(vectors)):
+            self._insert(node)
+
+    def _insert(self, node):
+        query = self.vectors[node]
+        level = int(-math.log(1.0 - self.rng.random()) * self.level_mult)
+        self.links.append([np.zeros(0, dtype=np.int64) for _ in range(level + 1)])
+        if self.entry is None:
+            self.entry, self.max_level = node, level
+            return
+
+        ep = self.entry
+        ep_dist = float(self._distances(query, [ep])[0])
+        for lc in range(self.max_level, level, -1):
+            ep, ep_dist = self._greedy(query, ep, ep_dist, lc)
+
+        entry_points = [(ep_dist, ep)]
+        for lc in range(min(level, self.max_level), -1, -1):
+            candidates = self._search_layer(query, entry_points, self.ef_construction, lc)
+            max_links = self.M0 if lc == 0 else self.M
+            ids = np.array([[n for _, n in candidates]], dtype=np.int64)
+            dists = np.array([[d for d, _ in candidates]], dtype=np.float32)
+            neighbours = np.take_along_axis(ids, self._select(ids, dists, self.M), 1)[0]
+            self.links[node][lc] = neighbours
+            # link back, re-selecting the links of the neighbours that now
+            # have too many all at once
+            full = []
+            for n in neighbours.tolist():
+                self.links[n][lc] = np.append(self.links[n][lc], node)
+                if len(self.links[n][lc]) > max_links:
+                    full.append(n)
+            if full:
+                links = np.array([self.links[n][lc] for n in full])
+                dists = 1.0 - np.einsum('ijk,ik->ij', self.vectors[links], self.vectors[full])
+                order = np.argsort(dists, axis=1, kind='mergesort')
+                links = np.take_along_axis(links, order, 1)
+                dists = np.take_along_axis(dists, order, 1)
+                links = np.take_along_axis(links, self._select(links, dists, max_links), 1)
+                for n, row in zip(full, links):
+                    self.links[n][lc] = row
+            entry_points = candidates
+
+        if level > self.max_level:
+            self.entry, self.max_level = node, level
+
+    def _select(self, ids, dists, m):
+        """Pick up to m neighbours in every row of ids, sorted by the
+        distances dists to the query of the row, preferring ones that are
+        closer to the query than to any neighbour already picked, so that
+        links spread out in different directions. Returns the positions of
+        the picked ids of every row, in order."""
+        rows, size = ids.shape
+        if size <= m:
+            return np.tile(np.arange(size), (rows, 1))
+        vectors = self.vectors[ids]
+        # distances between all pairs of candidates of a row
+        pairwise = 1.0 - np.matmul(vectors, vectors.transpose(0, 2, 1))
+        # prunes[r, j, i]: candidate j is closer to the earlier candidate i
+        # than to the query, so j is pruned if i is picked
+        prunes = (pairwise < dists[:, :, None]) & np.tri(size, size, -1, dtype=bool)
+        # a candidate is picked when no picked one prunes it; as that only
+        # depends on the earlier candidates, the iteration settles in at most
+        # size steps, mostly a few
+        picked = np.ones((rows, size), dtype=bool)
+        while True:
+            update = ~(prunes & picked[:, None, :]).any(axis=2)
+            if (update == picked).all():
+                break
+            picked = update
+        # the first m picked, then the first pruned ones if fewer were picked
+        return np.sort(np.argsort(~picked, axis=1, kind='mergesort')[:, :m], axis=1)
+
+    def _greedy(self, query, ep, ep_dist, lc):
+        """Walk towards the query in one level until no neighbour is closer."""
+        while True:
+            links = self.links[ep][lc]
+            if not len(links):
+                return ep, ep_dist
+            dists = self._distances(query, links)
+            best = int(np.argmin(dists))
+            if dists[best] >= ep_dist:
+                return ep, ep_dist
+            ep, ep_dist = int(links[best]), float(dists[best])
+
+    def _search_layer(self, query, entry_points, ef, lc, allowed=None, max_visits=None):
+        """Best-first search of one level, returning up to ef (distance, id)
+        pairs sorted by distance. Only nodes with allowed[id] set are returned,
+        but all nodes are used to navigate the graph; as few of them may be
+        allowed, the search stops after max_visits nodes."""
+        start = self.stamp
+        cand_dists = np.array([d for d, _ in entry_points], dtype=np.float32)
+        cand_ids = np.array([n for _, n in entry_points], dtype=np.int64)
+        self.marks[cand_ids] = start
+        self.stamp += 1
+        visited = len(cand_ids)
+        keep = np.ones(len(cand_ids), dtype=bool) if allowed is None else allowed[cand_ids]
+        dists, ids = cand_dists[keep], cand_ids[keep]
+
+        while len(cand_ids):
+            bound = dists.max() if len(dists) >= ef else np.inf
+            # expand the EXPAND closest candidates that may still improve the
+            # results, comparing all their neighbours with the query at once
+            closest = np.argsort(cand_dists, kind='mergesort')[:EXPAND]
+            closest = closest[cand_dists[closest] <= bound]
+            if not len(closest):
+                break
+            if max_visits is not None and visited >= max_visits:
+                break
+            links = np.concatenate([self.links[c][lc] for c in cand_ids[closest].tolist()])
+            keep = np.ones(len(cand_ids), dtype=bool)
+            keep[closest] = False
+            cand_dists, cand_ids = cand_dists[keep], cand_ids[keep]
+
+            neighbours = links[self.marks[links] < start]
+            # the same neighbour of several candidates keeps one of its stamps
+            stamps = np.arange(self.stamp, self.stamp + len(neighbours))
+            self.marks[neighbours] = stamps
+            self.stamp += len(neighbours)
+            neighbours = neighbours[self.marks[neighbours] == stamps]
+            if not len(neighbours):
+                continue
+            visited += len(neighbours)
+            new_dists = self._distances(query, neighbours)
+            closer = new_dists < bound
+            new_dists, neighbours = new_dists[closer], neighbours[closer]
+            cand_dists = np.concatenate([cand_dists, new_dists])
+            cand_ids = np.concatenate([cand_ids, neighbours])
+            if allowed is not None:
+                keep = allowed[neighbours]
+                new_dists, neighbours = new_dists[keep], neighbours[keep]
+            dists = np.concatenate([dists, new_dists])
+            ids = np.concatenate([ids, neighbours])
+            if len(dists) > ef:
+                best = np.argpartition(dists, ef - 1)[:ef]
+                dists, ids = dists[best], ids[best]
+
+        order = np.argsort(dists, kind='mergesort')
+        return list(zip(dists[order].tolist(), ids[order].tolist()))
+
+    def search(self, query, k, ef=50, label=None):
+        """Return the k nearest (id, cosine similarity), optionally only
+        among vectors with the given label."""
+        if self.entry is None:
+            return []
+        query = _normalize(np.asarray(query, dtype=np.float32))
+        ep = self.entry
+        ep_dist = float(self._distances(query, [ep])[0])
+        for lc in range(self.max_level, 0, -1):
+            ep, ep_dist = self._greedy(query, ep, ep_dist, lc)
+        ef = max(ef, k)
+        allowed, max_visits = None, None
+        if label is not None:
+            if label not in self.label_masks:
+                self.label_masks[label] = self.labels == label
+            allowed = self.label_masks[label]
+            count = int(allowed.sum())
+            if count <= EXACT_FACTOR * ef:
+                return self._exact_search(query, k, np.flatnonzero(allowed))
+            max_visits = VISIT_FACTOR * ef * len(self) // count
+        results = self._search_layer(query, [(ep_dist, ep)], ef, 0, allowed, max_visits)
+        return [(n, 1.0 - d) for d, n in results[:k]]
+
+    def _exact_search(self, query, k, ids):
+        """The k nearest of ids, by comparing the query with all of them."""
+        dists = self._distances(query, ids)
+        top = np.argsort(dists)[:k]
+        return [(int(ids[i]), 1.0 - float(dists[i])) for i in top]
+
+
+def brute_force_search(vectors, labels, query, k, label=None):
+    """Exact search over unit-normalised vectors, returning the same format
+    as HNSWIndex.search."""
+    sims = vectors.dot(_normalize(np.asarray(query, dtype=np.float32)))
+    if label is not None:
+        sims = np.where(labels == label, sims, -np.inf)
+    k = min(k, int(np.sum(np.isfinite(sims))))
+    top = np.argpartition(-sims, k - 1)[:k] if k > 0 else []
+    return sorted([(int(n), float(sims[n])) for n in top], key=lambda x: -x[1])
+
+
+def build_index(infile, outfile, M=16, ef_construction=100):
+    labels, vectors = load_vectors(infile)
+    start = time.time()
+    index = HNSWIndex(vectors.shape[1], M, ef_construction)
+    index.add(vectors, labels)
+    print('Indexed ' + str(len(index)) + ' vectors in ' + str(round(time.time() - start, 2)) + ' seconds')
+    with open(outfile, 'wb') as fh:
+        pickle.dump(index, fh, pickle.HIGHEST_PROTOCOL)
+
+
+def query_index(indexfile, queryfile, k, ef=50, label=None):
+    with open(indexfile, 'rb') as fh:
+        index = pickle.load(fh)
+    query_labels, queries = load_vectors(queryfile)
+    for i, (query_label, query) in enumerate(zip(query_labels, queries)):
+        results = index.search(query, k, ef, label)
+        print(str(i) + ' ' + query_label + ' -> ' + ' '.join(
+            '%d:%s:%.4f' % (n, index.labels[n], sim) for n, sim in results
+        ))
+
+
+def benchmark(infile, queryfile, k, M=16, ef_construction=100, efs=(10, 50, 100)):
+    """Compare build time, query latency and recall@k of the index against
+    exact search, without a label filter, filtered on the label of every
+    query, and filtered on the rarest label of the index."""
+    labels, vectors = load_vectors(infile)
+    query_labels, queries = load_vectors(queryfile)
+
+    start = time.time()
+    index = HNSWIndex(vectors.shape[1], M, ef_construction)
+    index.add(vectors, labels)
+    print('Build: %d vectors, %.2f seconds' % (len(index), time.time() - start))
+
+    names, counts = np.unique(index.labels.astype(str), return_counts=True)
+    rare = names[int(np.argmin(counts))]
+    cases = [
+        ('Unfiltered', [None] * len(queries)),
+        ('Filtered', list(query_labels)),
+        ('Rare label %s (%d vectors)' % (rare, counts.min()), [rare] * len(queries)),
+    ]
+    for name, filters in cases:
+        # the k-th best exact similarity; with duplicated programs several ids
+        # tie at the same distance, so recall counts results at least that close
+        exact, exact_times = [], []
+        for label, query in zip(filters, queries):
+            start = time.time()
+            results = brute_force_search(index.vectors, index.labels, query, k, label)
+            exact_times.append(time.time() - start)
+            exact.append((len(results), results[-1][1] if results else 0.0))
+        print('%s brute force: %.3f ms/query' % (name, 1000 * np.mean(exact_times)))
+
+        for ef in efs:
+            recalls, times = [], []
+            for label, query, (num_exact, kth_sim) in zip(filters, queries, exact):
+                start = time.time()
+                found = index.search(query, k, ef, label)
+                times.append(time.time() - start)
+                hits = sum(1 for _, sim in found if sim >= kth_sim - 1e-6)
+                recalls.append(hits / float(max(num_exact, 1)))
+            print('%s hnsw ef=%d: %.3f ms/query (p99 %.3f ms), recall@%d %.4f' % (
+                name, ef, 1000 * np.mean(times), 1000 * np.percentile(times, 99), k, np.mean(recalls)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    commands = parser.add_subparsers(dest='command')
+
+    build = commands.add_parser('build', help='build an index from a vectors file')
+    build.add_argument('vectors')
+    build.add_argument('index')
+    build.add_argument('--M', type=int, default=16, help='links per node')
+    build.add_argument('--ef-construction', type=int, default=100)
+
+    query = commands.add_parser('query', help='top-k neighbours of every vector in a file')
+    query.add_argument('index')
+    query.add_argument('queries')
+    query.add_argument('--k', type=int, default=10)
+    query.add_argument('--ef', type=int, default=50)
+    query.add_argument('--label', default=None, help='only return vectors with this label')
+
+    bench = commands.add_parser('benchmark', help='compare against brute force search')
+    bench.add_argument('vectors', help='vectors to index, e.g. the java vectors of the train trees')
+    bench.add_argument('queries', help='query vectors of the same space, e.g. the java vectors of the test trees')
+    bench.add_argument('--k', type=int, default=10)
+    bench.add_argument('--M', type=int, default=16)
+    bench.add_argument('--ef-construction', type=int, default=100)
+
+    args = parser.parse_args()
+    if args.command == 'build':
+        build_index(args.vectors, args.index, args.M, args.ef_construction)
+    elif args.command == 'query':
+        query_index(args.index, args.queries, args.k, args.ef, args.label)
+    elif args.command == 'benchmark':
+        benchmark(args.vectors, args.queries, args.k, args.M, args.ef_construction)
+    else:
+        parser.print_help()
+        sys.exit(1)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,65 @@
+"""Initialize the towers of a Bi-TBCNN from single-language TBCNN models.
+
+A tower of the Bi-TBCNN has the same convolution as the TBCNN of
+train_tbcnn.py, so a TBCNN trained on the trees of one language, with the
+same embeddings, is a good start for the tower of that language. The two
+TBCNNs are trained independently, at the same time if wanted, on single
+trees, which is much cheaper than training the towers on pairs.
+
+The towers can be frozen for the first epochs, so that only the hidden
+layers comparing the pooled vectors are trained at first."""
+
+import tensorflow as tf
+
+
+def add_arguments(parser):
+    """Add the warm start flags to a trainer's argument parser."""
+    group = parser.add_argument_group('warm start')
+    group.add_argument('--left-init', default=None, metavar='LOGDIR',
+                       help='initialize the left tower from the TBCNN checkpoint in LOGDIR')
+    group.add_argument('--right-init', default=None, metavar='LOGDIR',
+                       help='initialize the right tower from the TBCNN checkpoint in LOGDIR')
+    group.add_argument('--freeze-towers', type=int, default=0, metavar='EPOCHS',
+                       help='only train the hidden layers for the first EPOCHS epochs')
+
+
+def options(args):
+    """train_bitbcnn.train_model keyword arguments from the flags of add_arguments."""
+    return {
+        'left_init': args.left_init,
+        'right_init': args.right_init,
+        'freeze_towers': args.freeze_towers,
+    }
+
+
+def new_variables(build):
+    """Call build() and return its result and the variables it created."""
+    count = len(tf.global_variables())
+    result = build()
+    return result, tf.global_variables()[count:]
+
+
+def checkpoint_name(var):
+    """Name of the variable of a tower in a TBCNN checkpoint. Every tower is
+    built in its own network, network_1, ... scope, the TBCNN in network."""
+    _, rest = var.op.name.split('/', 1)
+    return 'network/' + rest
+
+
+def load_tower(sess, variables, logdir):
+    """Load the variables of a tower from the latest checkpoint of a TBCNN
+    trained by train_tbcnn.py."""
+    ckpt = tf.train.get_checkpoint_state(logdir)
+    if not ckpt or not ckpt.model_checkpoint_path:
+        raise IOError('Checkpoint not found in ' + logdir)
+    reader = tf.train.NewCheckpointReader(ckpt.model_checkpoint_path)
+    shapes = reader.get_variable_to_shape_map()
+    for var in variables:
+        name = checkpoint_name(var)
+        if name not in shapes:
+            raise ValueError('No ' + name + ' in ' + ckpt.model_checkpoint_path)
+        if list(shapes[name]) != var.get_shape().as_list():
+            raise ValueError('%s has shape %s in %s, the tower needs %s (trained with other embeddings?)'
+                             % (name, shapes[name], ckpt.model_checkpoint_path, var.get_shape().as_list()))
+        var.load(reader.get_tensor(name), sess)
+    print('Initialized ' + str(len(variables)) + ' tower variables from ' + ckpt.model_checkpoint_path)